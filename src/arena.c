@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define ARENA_ALIGN 16
+
+struct chunk {
+        struct chunk *next;
+        size_t used;
+        size_t size;
+        _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+struct arena {
+        int refs;
+        pthread_mutex_t lock;
+        struct chunk *chunks;
+        struct arena **held;
+        size_t held_count;
+        size_t held_capacity;
+};
+
+struct arena *arena_create(void)
+{
+        struct arena *arena = calloc(1, sizeof(struct arena));
+        if (!arena) {
+                perror("calloc");
+                return NULL;
+        }
+
+        arena->refs = 1;
+        pthread_mutex_init(&arena->lock, NULL);
+        return arena;
+}
+
+static struct chunk *new_chunk(size_t size)
+{
+        struct chunk *chunk = malloc(sizeof(struct chunk) + size);
+        if (!chunk) {
+                perror("malloc");
+                return NULL;
+        }
+
+        chunk->used = 0;
+        chunk->size = size;
+        return chunk;
+}
+
+// Returns zeroed memory that lives as long as the arena
+void *arena_alloc(struct arena *arena, size_t size)
+{
+        size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        void *ptr = NULL;
+
+        pthread_mutex_lock(&arena->lock);
+
+        struct chunk *chunk = arena->chunks;
+        if (!chunk || chunk->size - chunk->used < size) {
+                if (size > ARENA_CHUNK_SIZE / 4) {
+                        // Oversized: give it a chunk of its own behind the current one
+                        chunk = new_chunk(size);
+                        if (chunk && arena->chunks) {
+                                chunk->next = arena->chunks->next;
+                                arena->chunks->next = chunk;
+                        } else if (chunk) {
+                                chunk->next = NULL;
+                                arena->chunks = chunk;
+                        }
+                } else {
+                        chunk = new_chunk(ARENA_CHUNK_SIZE);
+                        if (chunk) {
+                                chunk->next = arena->chunks;
+                                arena->chunks = chunk;
+                        }
+                }
+        }
+
+        if (chunk) {
+                ptr = chunk->data + chunk->used;
+                chunk->used += size;
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+
+        if (ptr) memset(ptr, 0, size);
+        return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+        size_t len = strlen(str) + 1;
+        char *copy = arena_alloc(arena, len);
+        if (copy) memcpy(copy, str, len);
+        return copy;
+}
+
+struct arena *arena_ref(struct arena *arena)
+{
+        if (arena) arena->refs++;
+        return arena;
+}
+
+void arena_unref(struct arena *arena)
+{
+        if (!arena || --arena->refs > 0) return;
+
+        struct chunk *chunk = arena->chunks;
+        while (chunk) {
+                struct chunk *next = chunk->next;
+                free(chunk);
+                chunk = next;
+        }
+
+        for (size_t i = 0; i < arena->held_count; i++) {
+                arena_unref(arena->held[i]);
+        }
+
+        free(arena->held);
+        pthread_mutex_destroy(&arena->lock);
+        free(arena);
+}
+
+// Keeps other alive for as long as arena, once per pair
+void arena_hold(struct arena *arena, struct arena *other)
+{
+        if (!arena || !other || arena == other) return;
+
+        for (size_t i = 0; i < arena->held_count; i++) {
+                if (arena->held[i] == other) return;
+        }
+
+        if (arena->held_count == arena->held_capacity) {
+                size_t capacity = arena->held_capacity ? arena->held_capacity * 2 : 4;
+                struct arena **held = realloc(arena->held, capacity * sizeof(*held));
+                if (!held) {
+                        // Leaking other is safer than letting it go too early
+                        perror("realloc");
+                        arena_ref(other);
+                        return;
+                }
+                arena->held = held;
+                arena->held_capacity = capacity;
+        }
+
+        arena->held[arena->held_count++] = arena_ref(other);
+}
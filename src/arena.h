@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator that owns the nodes of a scanned or loaded tree. Nodes are
+ * never freed one by one: the whole arena goes away with its last
+ * reference. An arena that points into another one holds a reference to it
+ * (arena_hold), so shared nodes outlive the tree they were created for.
+ * Allocation is thread-safe; reference counting is not.
+ */
+
+struct arena;
+
+struct arena *arena_create(void);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+struct arena *arena_ref(struct arena *arena);
+void arena_unref(struct arena *arena);
+void arena_hold(struct arena *arena, struct arena *other);
+
+#endif
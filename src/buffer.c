@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+void buffer_init(struct buffer *buf)
+{
+        memset(buf, 0, sizeof(*buf));
+}
+
+void buffer_free(struct buffer *buf)
+{
+        free(buf->data);
+        buffer_init(buf);
+}
+
+static int buffer_reserve(struct buffer *buf, size_t len)
+{
+        if (buf->failed) return -1;
+        if (buf->len + len <= buf->cap) return 0;
+
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + len) cap *= 2;
+
+        unsigned char *data = realloc(buf->data, cap);
+        if (!data) {
+                perror("realloc");
+                buf->failed = 1;
+                return -1;
+        }
+
+        buf->data = data;
+        buf->cap = cap;
+        return 0;
+}
+
+void buffer_put(struct buffer *buf, const void *data, size_t len)
+{
+        if (buffer_reserve(buf, len) != 0) return;
+
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+}
+
+void buffer_put_u8(struct buffer *buf, uint8_t value)
+{
+        buffer_put(buf, &value, 1);
+}
+
+// Fixed-width integers are stored little-endian whatever the host order
+void buffer_put_u32(struct buffer *buf, uint32_t value)
+{
+        unsigned char bytes[4];
+        for (int i = 0; i < 4; i++) bytes[i] = value >> (i * 8);
+        buffer_put(buf, bytes, sizeof(bytes));
+}
+
+void buffer_put_u64(struct buffer *buf, uint64_t value)
+{
+        buffer_put_u32(buf, value);
+        buffer_put_u32(buf, value >> 32);
+}
+
+// LEB128: seven bits per byte, high bit set on all but the last
+void buffer_put_varint(struct buffer *buf, uint64_t value)
+{
+        unsigned char bytes[10];
+        size_t n = 0;
+
+        do {
+                bytes[n] = value & 0x7f;
+                value >>= 7;
+                if (value) bytes[n] |= 0x80;
+                n++;
+        } while (value);
+
+        buffer_put(buf, bytes, n);
+}
+
+// Zigzag-encoded so small negative values stay short
+void buffer_put_svarint(struct buffer *buf, int64_t value)
+{
+        buffer_put_varint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void buffer_put_string(struct buffer *buf, const char *str)
+{
+        size_t len = strlen(str);
+        buffer_put_varint(buf, len);
+        buffer_put(buf, str, len);
+}
+
+int buffer_write(struct buffer *buf, FILE *out)
+{
+        if (buf->failed) return -1;
+        if (buf->len == 0) return 0;
+
+        return fwrite(buf->data, buf->len, 1, out) == 1 ? 0 : -1;
+}
+
+void reader_init(struct reader *rd, const void *data, size_t len)
+{
+        rd->pos = data;
+        rd->end = rd->pos + len;
+        rd->failed = 0;
+}
+
+void reader_get(struct reader *rd, void *data, size_t len)
+{
+        if (rd->failed || (size_t)(rd->end - rd->pos) < len) {
+                rd->failed = 1;
+                memset(data, 0, len);
+                return;
+        }
+
+        memcpy(data, rd->pos, len);
+        rd->pos += len;
+}
+
+uint8_t reader_get_u8(struct reader *rd)
+{
+        uint8_t value;
+        reader_get(rd, &value, 1);
+        return value;
+}
+
+uint32_t reader_get_u32(struct reader *rd)
+{
+        unsigned char bytes[4];
+        reader_get(rd, bytes, sizeof(bytes));
+
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= (uint32_t)bytes[i] << (i * 8);
+        return value;
+}
+
+uint64_t reader_get_u64(struct reader *rd)
+{
+        uint64_t low = reader_get_u32(rd);
+        return low | (uint64_t)reader_get_u32(rd) << 32;
+}
+
+uint64_t reader_get_varint(struct reader *rd)
+{
+        uint64_t value = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+                uint8_t byte = reader_get_u8(rd);
+                if (rd->failed) return 0;
+
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+        }
+
+        rd->failed = 1;
+        return 0;
+}
+
+int64_t reader_get_svarint(struct reader *rd)
+{
+        uint64_t value = reader_get_varint(rd);
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Fails rather than truncates when the string does not fit in size bytes
+void reader_get_string(struct reader *rd, char *str, size_t size)
+{
+        uint64_t len = reader_get_varint(rd);
+        if (rd->failed || len >= size) {
+                rd->failed = 1;
+                str[0] = '\0';
+                return;
+        }
+
+        reader_get(rd, str, len);
+        str[len] = '\0';
+}
+
+int reader_done(const struct reader *rd)
+{
+        return rd->failed || rd->pos == rd->end;
+}
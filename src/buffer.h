@@ -0,0 +1,49 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Growable byte buffer used to build on-disk records in memory so they can
+ * be written with a single fwrite(), and a bounds-checked reader for parsing
+ * them back. Both keep a sticky error flag, so a sequence of puts or gets
+ * only needs to be checked once at the end.
+ */
+
+struct buffer {
+        unsigned char *data;
+        size_t len;
+        size_t cap;
+        int failed;
+};
+
+struct reader {
+        const unsigned char *pos;
+        const unsigned char *end;
+        int failed;
+};
+
+void buffer_init(struct buffer *buf);
+void buffer_free(struct buffer *buf);
+void buffer_put(struct buffer *buf, const void *data, size_t len);
+void buffer_put_u8(struct buffer *buf, uint8_t value);
+void buffer_put_u32(struct buffer *buf, uint32_t value);
+void buffer_put_u64(struct buffer *buf, uint64_t value);
+void buffer_put_varint(struct buffer *buf, uint64_t value);
+void buffer_put_svarint(struct buffer *buf, int64_t value);
+void buffer_put_string(struct buffer *buf, const char *str);
+int buffer_write(struct buffer *buf, FILE *out);
+
+void reader_init(struct reader *rd, const void *data, size_t len);
+void reader_get(struct reader *rd, void *data, size_t len);
+uint8_t reader_get_u8(struct reader *rd);
+uint32_t reader_get_u32(struct reader *rd);
+uint64_t reader_get_u64(struct reader *rd);
+uint64_t reader_get_varint(struct reader *rd);
+int64_t reader_get_svarint(struct reader *rd);
+void reader_get_string(struct reader *rd, char *str, size_t size);
+int reader_done(const struct reader *rd);
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "catalog.h"
+#include "buffer.h"
+
+#define CATALOG_VERSION 2
+#define CATALOG_HEADER_SIZE 5
+#define CATALOG_RECORD_SIZE 92
+#define CATALOG_V1_RECORD_SIZE 68
+
+static const char catalog_magic[4] = { 'S', 'V', 'D', 'C' };
+
+// A later record for an existing version supersedes the earlier one
+static int add_record(struct catalog *cat, const struct catalog_record *record)
+{
+        struct catalog_record *existing = (struct catalog_record *)catalog_find(cat, record->version);
+        if (existing) {
+                *existing = *record;
+                return 0;
+        }
+
+        if (cat->count > 0 && record->version < cat->records[cat->count - 1].version) {
+                fprintf(stderr, "Out of order catalog record: %d\n", record->version);
+                return -1;
+        }
+
+        if (cat->count == cat->capacity) {
+                size_t capacity = cat->capacity ? cat->capacity * 2 : 64;
+                struct catalog_record *records = realloc(cat->records, capacity * sizeof(*records));
+                if (!records) {
+                        perror("realloc");
+                        return -1;
+                }
+                cat->records = records;
+                cat->capacity = capacity;
+        }
+
+        cat->records[cat->count++] = *record;
+        return 0;
+}
+
+static void encode_record(struct buffer *buf, const struct catalog_record *record)
+{
+        buffer_put_u32(buf, record->version);
+        buffer_put_u32(buf, record->parent);
+        buffer_put(buf, record->hash, SHA_DIGEST_LENGTH);
+        buffer_put_u64(buf, record->timestamp);
+        buffer_put_u64(buf, record->entry_count);
+        buffer_put_u64(buf, record->raw_size);
+        buffer_put_u64(buf, record->stored_size);
+        buffer_put_u64(buf, record->offset);
+        buffer_put_u64(buf, record->added);
+        buffer_put_u64(buf, record->removed);
+        buffer_put_u64(buf, record->modified);
+}
+
+static void decode_record(struct reader *rd, struct catalog_record *record, int format)
+{
+        record->version = (int32_t)reader_get_u32(rd);
+        record->parent = (int32_t)reader_get_u32(rd);
+        reader_get(rd, record->hash, SHA_DIGEST_LENGTH);
+        record->timestamp = reader_get_u64(rd);
+        record->entry_count = reader_get_u64(rd);
+        record->raw_size = reader_get_u64(rd);
+        record->stored_size = reader_get_u64(rd);
+        record->offset = reader_get_u64(rd);
+
+        if (format < 2) {
+                record->added = record->removed = record->modified = CATALOG_UNKNOWN;
+                return;
+        }
+        record->added = reader_get_u64(rd);
+        record->removed = reader_get_u64(rd);
+        record->modified = reader_get_u64(rd);
+}
+
+// A missing catalog loads as an empty one
+struct catalog *load_catalog(const char *rev_dir)
+{
+        struct catalog *cat = calloc(1, sizeof(struct catalog));
+        if (!cat) {
+                perror("calloc");
+                return NULL;
+        }
+        snprintf(cat->path, sizeof(cat->path), "%s/catalog", rev_dir);
+
+        FILE *f = fopen(cat->path, "rb");
+        if (!f) return cat;
+
+        struct stat st;
+        unsigned char *data = NULL;
+        if (fstat(fileno(f), &st) == 0 && st.st_size >= CATALOG_HEADER_SIZE) {
+                data = malloc(st.st_size);
+        }
+
+        if (!data || fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+                fprintf(stderr, "Ignoring unreadable catalog: %s\n", cat->path);
+                free(data);
+                fclose(f);
+                return cat;
+        }
+        fclose(f);
+
+        struct reader rd;
+        char magic[sizeof(catalog_magic)];
+        reader_init(&rd, data, st.st_size);
+        reader_get(&rd, magic, sizeof(magic));
+
+        uint8_t format = reader_get_u8(&rd);
+        if (memcmp(magic, catalog_magic, sizeof(magic)) != 0 ||
+            format < 1 || format > CATALOG_VERSION) {
+                fprintf(stderr, "Ignoring unreadable catalog: %s\n", cat->path);
+                free(data);
+                return cat;
+        }
+        cat->format = format;
+
+        // A record cut short by an interrupted append is dropped
+        size_t record_size = format < 2 ? CATALOG_V1_RECORD_SIZE : CATALOG_RECORD_SIZE;
+        size_t count = (st.st_size - CATALOG_HEADER_SIZE) / record_size;
+        for (size_t i = 0; i < count; i++) {
+                struct catalog_record record;
+                decode_record(&rd, &record, format);
+                if (rd.failed || add_record(cat, &record) != 0) break;
+        }
+
+        free(data);
+        return cat;
+}
+
+/*
+ * Writes out every record held in memory followed by record, in the current
+ * format. Used to start a catalog and to upgrade one in an older format.
+ */
+static int rewrite_catalog(struct catalog *cat, const struct catalog_record *record)
+{
+        char tmp_path[PATH_MAX + 4];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cat->path);
+
+        struct buffer buf;
+        buffer_init(&buf);
+        buffer_put(&buf, catalog_magic, sizeof(catalog_magic));
+        buffer_put_u8(&buf, CATALOG_VERSION);
+        for (size_t i = 0; i < cat->count; i++) {
+                encode_record(&buf, &cat->records[i]);
+        }
+        encode_record(&buf, record);
+
+        FILE *f = fopen(tmp_path, "wb");
+        if (!f) {
+                perror("fopen");
+                buffer_free(&buf);
+                return -1;
+        }
+
+        int ret = buffer_write(&buf, f);
+        if (fclose(f) != 0) ret = -1;
+        if (ret == 0 && rename(tmp_path, cat->path) != 0) {
+                perror("rename");
+                ret = -1;
+        }
+        if (ret != 0) unlink(tmp_path);
+        buffer_free(&buf);
+
+        if (ret == 0) {
+                cat->format = CATALOG_VERSION;
+                ret = add_record(cat, record);
+        }
+        return ret;
+}
+
+int catalog_append(struct catalog *cat, const struct catalog_record *record)
+{
+        struct stat st;
+        if (cat->format != CATALOG_VERSION || stat(cat->path, &st) != 0 ||
+            st.st_size < CATALOG_HEADER_SIZE) {
+                return rewrite_catalog(cat, record);
+        }
+
+        if ((st.st_size - CATALOG_HEADER_SIZE) % CATALOG_RECORD_SIZE != 0) {
+                // Cut off a partial record left by an interrupted append
+                off_t whole = st.st_size - (st.st_size - CATALOG_HEADER_SIZE) % CATALOG_RECORD_SIZE;
+                if (truncate(cat->path, whole) != 0) {
+                        perror("truncate");
+                        return -1;
+                }
+        }
+
+        struct buffer buf;
+        buffer_init(&buf);
+        encode_record(&buf, record);
+
+        FILE *f = fopen(cat->path, "ab");
+        if (!f) {
+                perror("fopen");
+                buffer_free(&buf);
+                return -1;
+        }
+
+        int ret = buffer_write(&buf, f);
+        if (fclose(f) != 0) ret = -1;
+        buffer_free(&buf);
+
+        if (ret == 0) ret = add_record(cat, record);
+        return ret;
+}
+
+int catalog_next_version(const struct catalog *cat)
+{
+        return cat->count ? cat->records[cat->count - 1].version + 1 : 0;
+}
+
+// Versions are appended in increasing order, so this is a binary search
+const struct catalog_record *catalog_find(const struct catalog *cat, int version)
+{
+        size_t lo = 0, hi = cat->count;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (cat->records[mid].version == version) return &cat->records[mid];
+                if (cat->records[mid].version < version) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return NULL;
+}
+
+void free_catalog(struct catalog *cat)
+{
+        if (!cat) return;
+
+        free(cat->records);
+        free(cat);
+}
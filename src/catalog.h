@@ -0,0 +1,47 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <openssl/sha.h>
+
+/*
+ * Append-only list of the revisions of one snapshotted directory, stored as
+ * <rev_dir>/catalog. Records have a fixed size, so finding the next version
+ * or a given revision never needs to open the revision files themselves.
+ * Rewriting a revision appends a new record for it, which replaces the old
+ * one when the catalog is loaded.
+ */
+
+// Change counts of records carried over from a version 1 catalog
+#define CATALOG_UNKNOWN UINT64_MAX
+
+struct catalog_record {
+        int version;
+        int parent;
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        int64_t timestamp;
+        uint64_t entry_count;
+        uint64_t raw_size;      // Bytes of file content the revision describes
+        uint64_t stored_size;   // Size of the revision file
+        uint64_t offset;        // Where the tree or delta starts in that file
+        uint64_t added;         // Entries changed since the previous revision
+        uint64_t removed;
+        uint64_t modified;
+};
+
+struct catalog {
+        char path[PATH_MAX];
+        int format;             // Version of the file on disk, 0 if none
+        struct catalog_record *records;
+        size_t count;
+        size_t capacity;
+};
+
+struct catalog *load_catalog(const char *rev_dir);
+int catalog_append(struct catalog *cat, const struct catalog_record *record);
+int catalog_next_version(const struct catalog *cat);
+const struct catalog_record *catalog_find(const struct catalog *cat, int version);
+void free_catalog(struct catalog *cat);
+
+#endif
@@ -5,6 +5,18 @@
 
 #include "config.h"
 
+static void emit_int(yaml_emitter_t *emitter, const char *key, int value)
+{
+        yaml_event_t event;
+        char value_str[20];
+
+        snprintf(value_str, sizeof(value_str), "%d", value);
+        yaml_scalar_event_initialize(&event, NULL, NULL, (unsigned char *)key, strlen(key), 1, 1, YAML_PLAIN_SCALAR_STYLE);
+        yaml_emitter_emit(emitter, &event);
+        yaml_scalar_event_initialize(&event, NULL, NULL, (unsigned char *)value_str, strlen(value_str), 1, 1, YAML_PLAIN_SCALAR_STYLE);
+        yaml_emitter_emit(emitter, &event);
+}
+
 void serialize_config(const struct config *cfg, const char *filename)
 {
         FILE *file = fopen(filename, "w");
@@ -35,13 +47,17 @@ void serialize_config(const struct config *cfg, const char *filename)
         yaml_emitter_emit(&emitter, &event);
         yaml_scalar_event_initialize(&event, NULL, NULL, (unsigned char *)cfg->revisions, strlen(cfg->revisions), 1, 1, YAML_PLAIN_SCALAR_STYLE);
         yaml_emitter_emit(&emitter, &event);
-        yaml_scalar_event_initialize(&event, NULL, NULL, (unsigned char *)"compress_files", strlen("compress_files"), 1, 1, YAML_PLAIN_SCALAR_STYLE);
-        yaml_emitter_emit(&emitter, &event);
-
-        char compress_files_str[20];
-        snprintf(compress_files_str, sizeof(compress_files_str), "%d", cfg->compress_files);
-        yaml_scalar_event_initialize(&event, NULL, NULL, (unsigned char *)compress_files_str, strlen(compress_files_str), 1, 1, YAML_PLAIN_SCALAR_STYLE);
-        yaml_emitter_emit(&emitter, &event);
+        emit_int(&emitter, "compress_files", cfg->compress_files);
+        emit_int(&emitter, "threads", cfg->threads);
+        emit_int(&emitter, "readers", cfg->readers);
+        emit_int(&emitter, "hashers", cfg->hashers);
+        emit_int(&emitter, "compressors", cfg->compressors);
+        emit_int(&emitter, "queue_depth", cfg->queue_depth);
+        emit_int(&emitter, "stats", cfg->stats);
+        emit_int(&emitter, "keyframe_interval", cfg->keyframe_interval);
+        emit_int(&emitter, "max_chain_kb", cfg->max_chain_kb);
+        emit_int(&emitter, "reverse_deltas", cfg->reverse_deltas);
+        emit_int(&emitter, "incremental_restore", cfg->incremental_restore);
         yaml_mapping_end_event_initialize(&event);
         yaml_emitter_emit(&emitter, &event);
         yaml_document_end_event_initialize(&event, 0);
@@ -84,6 +100,26 @@ void deserialize_config(struct config *cfg, const char *filename)
                                 cfg->revisions = strdup(value);
                         } else if (strcmp(key, "compress_files") == 0) {
                                 cfg->compress_files = atoi(value);
+                        } else if (strcmp(key, "threads") == 0) {
+                                cfg->threads = atoi(value);
+                        } else if (strcmp(key, "readers") == 0) {
+                                cfg->readers = atoi(value);
+                        } else if (strcmp(key, "hashers") == 0) {
+                                cfg->hashers = atoi(value);
+                        } else if (strcmp(key, "compressors") == 0) {
+                                cfg->compressors = atoi(value);
+                        } else if (strcmp(key, "queue_depth") == 0) {
+                                cfg->queue_depth = atoi(value);
+                        } else if (strcmp(key, "stats") == 0) {
+                                cfg->stats = atoi(value);
+                        } else if (strcmp(key, "keyframe_interval") == 0) {
+                                cfg->keyframe_interval = atoi(value);
+                        } else if (strcmp(key, "max_chain_kb") == 0) {
+                                cfg->max_chain_kb = atoi(value);
+                        } else if (strcmp(key, "reverse_deltas") == 0) {
+                                cfg->reverse_deltas = atoi(value);
+                        } else if (strcmp(key, "incremental_restore") == 0) {
+                                cfg->incremental_restore = atoi(value);
                         }
                         
                         key[0] = '\0'; 
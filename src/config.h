@@ -4,8 +4,21 @@
 struct config {
         char *revisions;
         int compress_files;
+        int threads;
+        int readers;
+        int hashers;
+        int compressors;
+        int queue_depth;
+        int stats;
+        int keyframe_interval;
+        int max_chain_kb;
+        int reverse_deltas;
+        int incremental_restore;
 };
 
+// The loaded configuration, defined in main.c
+extern struct config config;
+
 void serialize_config(const struct config *cfg, const char *filename);
 void deserialize_config(struct config *cfg, const char *filename);
 
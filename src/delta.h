@@ -3,26 +3,58 @@
 
 #include "tree.h"
 
+/*
+ * A modified file. When the new content shares enough with the old one it
+ * is stored in the object store as a copy/insert delta against it, and
+ * stored_size records what the new version really cost.
+ */
 struct file_delta {
-        off_t offset;
+        size_t stored_size;
         size_t deleted_size;
         size_t added_size;
-        unsigned char *added_data;
-        unsigned char *deleted_data;
+        unsigned char deleted_hash[SHA_DIGEST_LENGTH];
+        unsigned char added_hash[SHA_DIGEST_LENGTH];
 };
 
+/*
+ * Changes to one directory. Entries added, removed or modified directly in
+ * it are listed by name; subdirectories whose contents changed get a nested
+ * delta of their own, so applying it only descends into changed paths.
+ * Nested deltas share the arena of the outermost one.
+ */
 struct tree_delta {
+        struct arena *arena;
         struct tree_entry *added_entries;
         struct tree_entry *removed_entries;
         struct tree_entry *modified_entries;
+        struct subtree_delta *subtrees;
+        // Where the next entry of each list is linked in
+        struct tree_entry **added_tail;
+        struct tree_entry **removed_tail;
+        struct tree_entry **modified_tail;
+        struct subtree_delta **subtrees_tail;
+        size_t pruned_subtrees;
+};
+
+struct subtree_delta {
+        const char *name;
+        // Merkle hash of the subdirectory once the delta is applied
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        struct tree_delta *delta;
+        struct subtree_delta *next;
 };
 
-void append_tree_entry_to_list(struct tree_entry **list, struct tree_entry *new_entry);
-struct tree_entry *clone_tree_entry(const struct tree_entry *original);
 struct tree_delta *calculate_tree_delta(struct tree *old_tree, struct tree *new_tree);
 void apply_tree_delta(struct tree *tree, const struct tree_delta *delta);
 void free_tree_delta(struct tree_delta *delta);
-int serialize_tree_delta(FILE *out, struct tree_delta *delta);
-int deserialize_tree_delta(FILE *in, struct tree_delta **delta);
+void encode_tree_delta(struct buffer *buf, const struct tree_delta *delta);
+size_t print_tree_delta(FILE *out, const struct tree_delta *delta, int show_sizes);
+void count_tree_delta(const struct tree_delta *delta, uint64_t *added,
+                      uint64_t *removed, uint64_t *modified);
+int decode_tree_delta(struct reader *rd, struct tree_delta **delta);
+int compute_file_delta(const unsigned char *base, size_t base_size,
+                       const unsigned char *data, size_t size, FILE *ops);
+int apply_file_delta(int base_fd, FILE *ops, FILE *dst);
+int store_file_delta(struct tree_entry *entry);
 
 #endif
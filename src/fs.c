@@ -219,8 +219,9 @@ int remove_dir(const char *path)
                  continue;
 
                 snprintf(file_path, sizeof(file_path), "%s/%s", path, p->d_name);
+                // lstat, so that a symlink to a directory is unlinked, not followed
                 struct stat statbuf;
-                stat(file_path, &statbuf);
+                if (lstat(file_path, &statbuf) < 0) continue;
 
                 if (S_ISDIR(statbuf.st_mode))
                         remove_dir(file_path);
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "gc.h"
+#include "tree.h"
+#include "delta.h"
+#include "object.h"
+#include "revision.h"
+
+#define EMPTY_SLOT SIZE_MAX
+
+/*
+ * Marked hashes in the order they were added, with an open addressing
+ * table over them. New hashes can be appended while the list is walked,
+ * which is how delta bases are followed.
+ */
+struct mark_set {
+        unsigned char (*hashes)[SHA_DIGEST_LENGTH];
+        size_t count;
+        size_t capacity;
+        size_t *slots;
+        size_t slot_count;
+};
+
+// Content hashes are uniformly distributed already
+static size_t *find_slot(struct mark_set *set, const unsigned char *hash)
+{
+        size_t mask = set->slot_count - 1;
+        uint64_t h;
+        memcpy(&h, hash, sizeof(h));
+        size_t i = h & mask;
+
+        while (set->slots[i] != EMPTY_SLOT) {
+                if (memcmp(set->hashes[set->slots[i]], hash, SHA_DIGEST_LENGTH) == 0) {
+                        break;
+                }
+                i = (i + 1) & mask;
+        }
+        return &set->slots[i];
+}
+
+static int rehash(struct mark_set *set, size_t slot_count)
+{
+        size_t *slots = malloc(slot_count * sizeof(size_t));
+        if (!slots) {
+                perror("malloc");
+                return -1;
+        }
+
+        for (size_t i = 0; i < slot_count; i++) {
+                slots[i] = EMPTY_SLOT;
+        }
+
+        free(set->slots);
+        set->slots = slots;
+        set->slot_count = slot_count;
+
+        for (size_t i = 0; i < set->count; i++) {
+                *find_slot(set, set->hashes[i]) = i;
+        }
+        return 0;
+}
+
+static int is_marked(struct mark_set *set, const unsigned char *hash)
+{
+        return set->slot_count && *find_slot(set, hash) != EMPTY_SLOT;
+}
+
+static int mark(struct mark_set *set, const unsigned char *hash)
+{
+        if (is_marked(set, hash)) return 0;
+
+        if (set->count == set->capacity) {
+                size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+                void *hashes = realloc(set->hashes, capacity * SHA_DIGEST_LENGTH);
+                if (!hashes) {
+                        perror("realloc");
+                        return -1;
+                }
+                set->hashes = hashes;
+                set->capacity = capacity;
+        }
+
+        if ((set->count + 1) * 2 > set->slot_count) {
+                if (rehash(set, set->slot_count ? set->slot_count * 2 : 2048) != 0) {
+                        return -1;
+                }
+        }
+
+        memcpy(set->hashes[set->count], hash, SHA_DIGEST_LENGTH);
+        *find_slot(set, hash) = set->count++;
+        return 0;
+}
+
+static int mark_tree(struct mark_set *set, const struct tree *tree)
+{
+        for (const struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                if (entry->blob && mark(set, entry->blob->hash) != 0) return -1;
+                if (entry->subtree && mark_tree(set, entry->subtree) != 0) return -1;
+        }
+        return 0;
+}
+
+/*
+ * A delta names every blob that entered the tree with it. Removed entries
+ * are left out: their contents are held by the revision they came from.
+ */
+static int mark_delta(struct mark_set *set, const struct tree_delta *delta)
+{
+        for (const struct tree_entry *entry = delta->added_entries; entry; entry = entry->next) {
+                if (entry->blob && mark(set, entry->blob->hash) != 0) return -1;
+                if (entry->subtree && mark_tree(set, entry->subtree) != 0) return -1;
+        }
+        for (const struct tree_entry *entry = delta->modified_entries; entry; entry = entry->next) {
+                if (entry->blob && mark(set, entry->blob->hash) != 0) return -1;
+        }
+        for (const struct subtree_delta *sub = delta->subtrees; sub; sub = sub->next) {
+                if (mark_delta(set, sub->delta) != 0) return -1;
+        }
+        return 0;
+}
+
+/*
+ * Every revision file of the directory adds what its tree or delta refers
+ * to. The files are listed directly rather than through the catalog, so a
+ * revision the catalog does not know of still keeps its objects.
+ */
+static int mark_revisions(struct mark_set *set, const char *rev_dir)
+{
+        DIR *dir = opendir(rev_dir);
+        if (!dir) {
+                perror("opendir");
+                return -1;
+        }
+
+        int ret = 0;
+        struct dirent *d;
+        while (ret == 0 && (d = readdir(dir)) != NULL) {
+                const char *digits = d->d_name + strlen("revision_");
+                if (strncmp(d->d_name, "revision_", strlen("revision_")) != 0 || !*digits ||
+                    strspn(digits, "0123456789") != strlen(digits)) {
+                        continue;
+                }
+
+                char rev_path[PATH_MAX];
+                int n = snprintf(rev_path, sizeof(rev_path), "%s/%s", rev_dir, d->d_name);
+                if (n < 0 || (size_t)n >= sizeof(rev_path)) {
+                        fprintf(stderr, "Path too long: %s/%s\n", rev_dir, d->d_name);
+                        ret = -1;
+                        break;
+                }
+
+                struct revision *rev = load_revision_from_file(rev_path);
+                if (!rev) {
+                        fprintf(stderr, "Cannot read %s\n", rev_path);
+                        ret = -1;
+                        break;
+                }
+
+                if (rev->base_tree) {
+                        ret = mark_tree(set, rev->base_tree);
+                } else if (rev->delta) {
+                        ret = mark_delta(set, rev->delta);
+                }
+                free_revision(rev);
+        }
+
+        closedir(dir);
+        return ret;
+}
+
+// Delta objects need their base, which may itself be a delta
+static int mark_delta_bases(struct mark_set *set)
+{
+        for (size_t i = 0; i < set->count; i++) {
+                struct object_header hdr;
+                if (read_object_header(set->hashes[i], &hdr) != 0 || !hdr.is_delta) continue;
+                if (mark(set, hdr.base_hash) != 0) return -1;
+        }
+        return 0;
+}
+
+static int parse_hex(const char *hex, unsigned char *hash, int len)
+{
+        for (int i = 0; i < len; i++) {
+                unsigned int byte;
+                if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+                hash[i] = byte;
+        }
+        return 0;
+}
+
+// Unlinks objects that are not marked; temporary files are never object names
+static void sweep_objects(struct mark_set *set)
+{
+        size_t removed = 0;
+        unsigned long long bytes = 0;
+
+        for (int prefix = 0; prefix < 256; prefix++) {
+                char dir_path[PATH_MAX];
+                snprintf(dir_path, sizeof(dir_path), "%s/objects/%02x", config.revisions, prefix);
+
+                DIR *dir = opendir(dir_path);
+                if (!dir) continue;
+
+                struct dirent *d;
+                while ((d = readdir(dir)) != NULL) {
+                        unsigned char hash[SHA_DIGEST_LENGTH];
+
+                        // The directory holds the first byte, the name the rest
+                        if (strlen(d->d_name) != SHA_DIGEST_LENGTH * 2 - 2 ||
+                            strspn(d->d_name, "0123456789abcdef") != SHA_DIGEST_LENGTH * 2 - 2) {
+                                continue;
+                        }
+                        hash[0] = prefix;
+                        if (parse_hex(d->d_name, hash + 1, SHA_DIGEST_LENGTH - 1) != 0 ||
+                            is_marked(set, hash)) {
+                                continue;
+                        }
+
+                        char path[PATH_MAX];
+                        struct stat st;
+                        if (object_path(hash, path, sizeof(path)) != 0 || lstat(path, &st) != 0) {
+                                continue;
+                        }
+
+                        if (unlink(path) != 0) {
+                                perror("unlink");
+                                continue;
+                        }
+                        removed++;
+                        bytes += st.st_size;
+                }
+
+                closedir(dir);
+        }
+
+        printf("Removed %zu unreferenced objects (%llu bytes)\n", removed, bytes);
+}
+
+/*
+ * Marks from every snapshotted directory under config.revisions, then
+ * sweeps the object store. Nothing is removed unless every revision file
+ * could be read, since an unreadable one may hold the only reference to
+ * an object. The store lock is held throughout, so no snapshot can add or
+ * reuse an object between the mark and the sweep.
+ */
+int collect_garbage(void)
+{
+        int lock = lock_object_store(1);
+        if (lock < 0) return -1;
+
+        struct mark_set set = { 0 };
+
+        DIR *dir = opendir(config.revisions);
+        if (!dir) {
+                perror("opendir");
+                unlock_object_store(lock);
+                return -1;
+        }
+
+        int ret = 0;
+        struct dirent *d;
+        while (ret == 0 && (d = readdir(dir)) != NULL) {
+                if (d->d_name[0] == '.' || strcmp(d->d_name, "objects") == 0) continue;
+
+                char rev_dir[PATH_MAX];
+                struct stat st;
+                snprintf(rev_dir, sizeof(rev_dir), "%s/%s", config.revisions, d->d_name);
+                if (stat(rev_dir, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+
+                ret = mark_revisions(&set, rev_dir);
+        }
+        closedir(dir);
+
+        if (ret == 0) ret = mark_delta_bases(&set);
+
+        if (ret == 0) {
+                sweep_objects(&set);
+        } else {
+                fprintf(stderr, "Not removing any objects: the store could not be fully read\n");
+        }
+
+        free(set.hashes);
+        free(set.slots);
+        unlock_object_store(lock);
+        return ret;
+}
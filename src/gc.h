@@ -0,0 +1,13 @@
+#ifndef GC_H
+#define GC_H
+
+/*
+ * Object store garbage collection. Objects are shared by every snapshotted
+ * directory, so discarding one directory's revisions frees nothing by
+ * itself; this pass marks every object the remaining revisions refer to,
+ * including the bases of delta objects, and unlinks the rest.
+ */
+
+int collect_garbage(void);
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "index.h"
+
+#define INDEX_VERSION 1
+#define EMPTY_SLOT SIZE_MAX
+
+static const char index_magic[4] = { 'S', 'V', 'D', 'I' };
+
+static uint64_t hash_path(const char *path)
+{
+        uint64_t h = 1469598103934665603ULL;
+        while (*path) {
+                h ^= (unsigned char)*path++;
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+        if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec ? -1 : 1;
+        if (a->tv_nsec != b->tv_nsec) return a->tv_nsec < b->tv_nsec ? -1 : 1;
+        return 0;
+}
+
+static size_t *find_slot(struct index *idx, const char *path)
+{
+        size_t mask = idx->slot_count - 1;
+        size_t i = hash_path(path) & mask;
+
+        while (idx->slots[i] != EMPTY_SLOT) {
+                if (strcmp(idx->entries[idx->slots[i]].path, path) == 0) {
+                        break;
+                }
+                i = (i + 1) & mask;
+        }
+        return &idx->slots[i];
+}
+
+static int rehash(struct index *idx, size_t slot_count)
+{
+        size_t *slots = malloc(slot_count * sizeof(size_t));
+        if (!slots) {
+                perror("malloc");
+                return -1;
+        }
+
+        for (size_t i = 0; i < slot_count; i++) {
+                slots[i] = EMPTY_SLOT;
+        }
+
+        free(idx->slots);
+        idx->slots = slots;
+        idx->slot_count = slot_count;
+
+        for (size_t i = 0; i < idx->count; i++) {
+                *find_slot(idx, idx->entries[i].path) = i;
+        }
+        return 0;
+}
+
+static struct index_entry *add_entry(struct index *idx, const char *path)
+{
+        if (idx->count == idx->capacity) {
+                size_t capacity = idx->capacity ? idx->capacity * 2 : 256;
+                struct index_entry *entries = realloc(idx->entries, capacity * sizeof(*entries));
+                if (!entries) {
+                        perror("realloc");
+                        return NULL;
+                }
+                idx->entries = entries;
+                idx->capacity = capacity;
+        }
+
+        if ((idx->count + 1) * 2 > idx->slot_count) {
+                if (rehash(idx, idx->slot_count ? idx->slot_count * 2 : 512) != 0) {
+                        return NULL;
+                }
+        }
+
+        struct index_entry *entry = &idx->entries[idx->count];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = strdup(path);
+        if (!entry->path) {
+                perror("strdup");
+                return NULL;
+        }
+
+        *find_slot(idx, path) = idx->count++;
+        return entry;
+}
+
+static struct index *new_index(void)
+{
+        struct index *idx = calloc(1, sizeof(struct index));
+        if (!idx) {
+                perror("calloc");
+                return NULL;
+        }
+
+        if (rehash(idx, 512) != 0) {
+                free(idx);
+                return NULL;
+        }
+
+        pthread_mutex_init(&idx->lock, NULL);
+
+        clock_gettime(CLOCK_REALTIME, &idx->scan_time);
+        return idx;
+}
+
+struct index *load_index(const char *path)
+{
+        struct index *idx = new_index();
+        if (!idx) return NULL;
+
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+                // No index yet: every file is read on this snapshot
+                return idx;
+        }
+
+        char magic[sizeof(index_magic)];
+        uint32_t version;
+        int64_t sec, nsec;
+        uint64_t count;
+
+        if (fread(magic, sizeof(magic), 1, f) != 1 ||
+            fread(&version, sizeof(version), 1, f) != 1 ||
+            memcmp(magic, index_magic, sizeof(magic)) != 0 ||
+            version != INDEX_VERSION ||
+            fread(&sec, sizeof(sec), 1, f) != 1 ||
+            fread(&nsec, sizeof(nsec), 1, f) != 1 ||
+            fread(&count, sizeof(count), 1, f) != 1) {
+                fprintf(stderr, "Ignoring unreadable index: %s\n", path);
+                fclose(f);
+                return idx;
+        }
+
+        idx->prev_scan_time.tv_sec = sec;
+        idx->prev_scan_time.tv_nsec = nsec;
+
+        for (uint64_t i = 0; i < count; i++) {
+                uint16_t path_len;
+                char entry_path[PATH_MAX];
+                uint64_t ino, size, compressed_size;
+                int64_t times[4];
+                uint32_t mode;
+                unsigned char hash[SHA_DIGEST_LENGTH];
+
+                if (fread(&path_len, sizeof(path_len), 1, f) != 1 ||
+                    path_len >= sizeof(entry_path) ||
+                    fread(entry_path, 1, path_len, f) != path_len ||
+                    fread(&ino, sizeof(ino), 1, f) != 1 ||
+                    fread(&size, sizeof(size), 1, f) != 1 ||
+                    fread(&mode, sizeof(mode), 1, f) != 1 ||
+                    fread(times, sizeof(times), 1, f) != 1 ||
+                    fread(&compressed_size, sizeof(compressed_size), 1, f) != 1 ||
+                    fread(hash, sizeof(hash), 1, f) != 1) {
+                        fprintf(stderr, "Truncated index: %s\n", path);
+                        break;
+                }
+                entry_path[path_len] = '\0';
+
+                struct index_entry *entry = add_entry(idx, entry_path);
+                if (!entry) break;
+
+                entry->ino = ino;
+                entry->size = size;
+                entry->mode = mode;
+                entry->mtime.tv_sec = times[0];
+                entry->mtime.tv_nsec = times[1];
+                entry->ctime.tv_sec = times[2];
+                entry->ctime.tv_nsec = times[3];
+                entry->compressed_size = compressed_size;
+                memcpy(entry->hash, hash, sizeof(hash));
+        }
+
+        fclose(f);
+        return idx;
+}
+
+int save_index(struct index *idx, const char *path)
+{
+        if (!idx || !path) return -1;
+
+        char tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+        FILE *f = fopen(tmp_path, "wb");
+        if (!f) {
+                perror("fopen");
+                return -1;
+        }
+
+        uint32_t version = INDEX_VERSION;
+        int64_t sec = idx->scan_time.tv_sec;
+        int64_t nsec = idx->scan_time.tv_nsec;
+        uint64_t count = 0;
+
+        for (size_t i = 0; i < idx->count; i++) {
+                if (idx->entries[i].seen) count++;
+        }
+
+        if (fwrite(index_magic, sizeof(index_magic), 1, f) != 1 ||
+            fwrite(&version, sizeof(version), 1, f) != 1 ||
+            fwrite(&sec, sizeof(sec), 1, f) != 1 ||
+            fwrite(&nsec, sizeof(nsec), 1, f) != 1 ||
+            fwrite(&count, sizeof(count), 1, f) != 1) {
+                fclose(f);
+                unlink(tmp_path);
+                return -1;
+        }
+
+        // Entries not seen by the last scan belong to deleted files
+        for (size_t i = 0; i < idx->count; i++) {
+                struct index_entry *entry = &idx->entries[i];
+                if (!entry->seen) continue;
+
+                uint16_t path_len = strlen(entry->path);
+                uint64_t ino = entry->ino;
+                uint64_t size = entry->size;
+                uint32_t mode = entry->mode;
+                uint64_t compressed_size = entry->compressed_size;
+                int64_t times[4] = {
+                        entry->mtime.tv_sec, entry->mtime.tv_nsec,
+                        entry->ctime.tv_sec, entry->ctime.tv_nsec
+                };
+
+                if (fwrite(&path_len, sizeof(path_len), 1, f) != 1 ||
+                    fwrite(entry->path, 1, path_len, f) != path_len ||
+                    fwrite(&ino, sizeof(ino), 1, f) != 1 ||
+                    fwrite(&size, sizeof(size), 1, f) != 1 ||
+                    fwrite(&mode, sizeof(mode), 1, f) != 1 ||
+                    fwrite(times, sizeof(times), 1, f) != 1 ||
+                    fwrite(&compressed_size, sizeof(compressed_size), 1, f) != 1 ||
+                    fwrite(entry->hash, sizeof(entry->hash), 1, f) != 1) {
+                        fclose(f);
+                        unlink(tmp_path);
+                        return -1;
+                }
+        }
+
+        if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+                perror("rename");
+                unlink(tmp_path);
+                return -1;
+        }
+
+        return 0;
+}
+
+void free_index(struct index *idx)
+{
+        if (!idx) return;
+
+        for (size_t i = 0; i < idx->count; i++) {
+                free(idx->entries[i].path);
+        }
+        free(idx->entries);
+        free(idx->slots);
+        pthread_mutex_destroy(&idx->lock);
+        free(idx);
+}
+
+/*
+ * Copies out the cached hash for path only if its stat data still matches.
+ * Files modified at or after the previous scan started are treated as dirty,
+ * since a write in the same timestamp tick would otherwise go unnoticed.
+ * Safe to call from several scanner threads at once.
+ */
+int index_lookup(struct index *idx, const char *path, const struct stat *st,
+                 unsigned char *hash, size_t *compressed_size)
+{
+        if (!idx || !path || !st) return 0;
+
+        int found = 0;
+        pthread_mutex_lock(&idx->lock);
+
+        size_t slot = *find_slot(idx, path);
+        if (slot != EMPTY_SLOT) {
+                const struct index_entry *entry = &idx->entries[slot];
+
+                if (entry->ino == st->st_ino &&
+                    entry->size == st->st_size &&
+                    entry->mode == st->st_mode &&
+                    timespec_cmp(&entry->mtime, &st->st_mtim) == 0 &&
+                    timespec_cmp(&entry->ctime, &st->st_ctim) == 0 &&
+                    timespec_cmp(&entry->mtime, &idx->prev_scan_time) < 0) {
+                        memcpy(hash, entry->hash, SHA_DIGEST_LENGTH);
+                        *compressed_size = entry->compressed_size;
+                        found = 1;
+                }
+        }
+
+        pthread_mutex_unlock(&idx->lock);
+        return found;
+}
+
+int index_update(struct index *idx, const char *path, const struct stat *st,
+                 const unsigned char *hash, size_t compressed_size)
+{
+        if (!idx || !path || !st || !hash) return -1;
+
+        pthread_mutex_lock(&idx->lock);
+
+        size_t slot = *find_slot(idx, path);
+        struct index_entry *entry = slot != EMPTY_SLOT ? &idx->entries[slot] : add_entry(idx, path);
+        if (!entry) {
+                pthread_mutex_unlock(&idx->lock);
+                return -1;
+        }
+
+        entry->ino = st->st_ino;
+        entry->size = st->st_size;
+        entry->mode = st->st_mode;
+        entry->mtime = st->st_mtim;
+        entry->ctime = st->st_ctim;
+        entry->compressed_size = compressed_size;
+        memcpy(entry->hash, hash, SHA_DIGEST_LENGTH);
+        entry->seen = 1;
+
+        pthread_mutex_unlock(&idx->lock);
+        return 0;
+}
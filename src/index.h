@@ -0,0 +1,47 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+/*
+ * Per-directory stat cache, stored as <rev_dir>/index. Maps a path relative
+ * to the snapshotted directory to the stat data and content hash it had the
+ * last time it was read, so unchanged files can skip read/hash/compress.
+ */
+
+struct index_entry {
+        char *path;
+        ino_t ino;
+        off_t size;
+        mode_t mode;
+        struct timespec mtime;
+        struct timespec ctime;
+        size_t compressed_size;
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        int seen;
+};
+
+struct index {
+        struct index_entry *entries;
+        size_t count;
+        size_t capacity;
+        size_t *slots;
+        size_t slot_count;
+        struct timespec scan_time;
+        struct timespec prev_scan_time;
+        pthread_mutex_t lock;
+};
+
+struct index *load_index(const char *path);
+int save_index(struct index *idx, const char *path);
+void free_index(struct index *idx);
+int index_lookup(struct index *idx, const char *path, const struct stat *st,
+                 unsigned char *hash, size_t *compressed_size);
+int index_update(struct index *idx, const char *path, const struct stat *st,
+                 const unsigned char *hash, size_t compressed_size);
+
+#endif
@@ -19,10 +19,16 @@ struct options opts = {
         .path = NULL,
         .store = 0,
         .restore = 0,
-        .revision = 0,
+        .revision = -1,
         .discard = 0,
         .list = 0,
         .compare = 0,
+        .diff = 0,
+        .to = -1,
+        .threads = 0,
+        .stats = 0,
+        .incremental = 0,
+        .restore_path = NULL,
         .version = 0,
         .help = 0
 };
@@ -38,12 +44,18 @@ static int parse_options(int argc, char *argv[])
                 {"discard", required_argument, 0, 'd'},
                 {"list", required_argument, 0, 'l'},
                 {"compare", required_argument, 0, 'c'},
+                {"diff", required_argument, 0, 'D'},
+                {"to", required_argument, 0, 'T'},
+                {"threads", required_argument, 0, 't'},
+                {"stats", no_argument, 0, 'S'},
+                {"incremental", no_argument, 0, 'i'},
+                {"path", required_argument, 0, 'p'},
                 {"version", no_argument, 0, 'v'},
                 {"help", no_argument, 0, 'h'},
                 {0, 0, 0, 0}
         };
 
-        while ((opt = getopt_long(argc, argv, "s:r:R:d:l:c:h", long_options, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "s:r:R:d:l:c:D:T:t:Sip:h", long_options, NULL)) != -1) {
                 switch (opt) {
                 case 's':
                         opts.path = strdup(optarg);
@@ -73,8 +85,37 @@ static int parse_options(int argc, char *argv[])
                         opts.list = 1;
                         break;
                 case 'c':
+                        opts.path = strdup(optarg);
                         opts.compare = 1;
                         break;
+                case 'D':
+                        opts.path = strdup(optarg);
+                        opts.diff = 1;
+                        break;
+                case 'T':
+                        opts.to = atoi(optarg);
+                        if (opts.to < 0) {
+                            fprintf(stderr, "Error: invalid revision number\n");
+                            return 1;
+                        }
+                        break;
+                case 't':
+                        opts.threads = atoi(optarg);
+                        if (opts.threads < 1) {
+                            fprintf(stderr, "Error: invalid thread count\n");
+                            return 1;
+                        }
+                        break;
+                case 'S':
+                        opts.stats = 1;
+                        break;
+                case 'i':
+                        opts.incremental = 1;
+                        break;
+                case 'p':
+                        free(opts.restore_path);
+                        opts.restore_path = strdup(optarg);
+                        break;
                 case 'h':
                         opts.help = 1;
                         break;
@@ -98,15 +139,23 @@ static void print_help()
         printf("  -s, --store        Store a new snapshot\n");
         printf("  -r, --restore      Restore from a snapshot\n");
         printf("  -R, --revision=N   Specify revision number for restore/compare\n");
-        printf("  -d, --discard      Discard specified snapshot\n");
+        printf("  -d, --discard      Discard specified snapshot, then remove stored file\n");
+        printf("                     contents no other snapshot refers to\n");
         printf("  -l, --list         List available snapshots\n");
-        printf("  -c, --compare      Compare current state with snapshot\n");
+        printf("  -c, --compare      Compare current state with snapshot (latest unless -R);\n");
+        printf("                     exits 0 if unchanged, 1 if changed, 2 on error\n");
+        printf("  -D, --diff         List changes from revision -R (default 0) to -T\n");
+        printf("  -T, --to=N         Revision to diff to (default latest); -S adds sizes\n");
+        printf("  -t, --threads=N    Number of worker threads (overrides config)\n");
+        printf("  -S, --stats        Print pipeline queue statistics\n");
+        printf("  -i, --incremental  Restore by rewriting only files that differ\n");
+        printf("  -p, --path=REL     Restore only this file or subdirectory\n");
         printf("  -h, --help         Display this help message\n");
 }
 
 static void print_usage(const char *program_name)
 {
-        printf("Usage: %s [-s store] [-r restore] [-d discard]\n    [-l list] [-c compare] [-R revision] [-h help]\n", program_name);
+        printf("Usage: %s [-s store] [-r restore] [-d discard]\n    [-l list] [-c compare] [-D diff] [-R revision] [-T to] [-t threads] [-S stats]\n    [-i incremental] [-p path] [-h help]\n", program_name);
 }
 
 void print_args() 
@@ -119,10 +168,13 @@ void print_args()
         printf("    Discard: %d\n", opts.discard);
         printf("    List: %d\n", opts.list);
         printf("    Compare: %d\n", opts.compare);
+        printf("    Threads: %d\n", opts.threads);
 }
 
 int main(int argc, char *argv[])
 {
+        int ret = 0;
+
         (void)deserialize_config(&config, "/etc/svd/config");
 
         if (parse_options(argc, argv) != 0) {
@@ -130,6 +182,18 @@ int main(int argc, char *argv[])
                 return 1;
         }
 
+        if (opts.threads > 0) {
+                config.threads = opts.threads;
+        }
+
+        if (opts.stats) {
+                config.stats = 1;
+        }
+
+        if (opts.incremental) {
+                config.incremental_restore = 1;
+        }
+
         // print_args();
 
         if (opts.help) {
@@ -138,26 +202,38 @@ int main(int argc, char *argv[])
         }
 
         if (opts.store) {
-                create_snapshot(opts.path);
+                ret = create_snapshot(opts.path) != 0;
                 goto cleanup;
         } 
 
         if (opts.restore) {
-                restore_snapshot(opts.path, opts.revision);
+                ret = restore_snapshot(opts.path, opts.revision < 0 ? 0 : opts.revision,
+                                       opts.restore_path) != 0;
+                goto cleanup;
+        }
+
+        if (opts.compare) {
+                ret = compare_snapshot(opts.path, opts.revision);
+                goto cleanup;
+        }
+
+        if (opts.diff) {
+                ret = diff_snapshot(opts.path, opts.revision, opts.to);
                 goto cleanup;
         }
 
         if (opts.discard) {
-                discard_snapshot(opts.path);
+                ret = discard_snapshot(opts.path) != 0;
                 goto cleanup;
         }
 
         if (opts.list) {
-                list_snapshot(opts.path);
+                ret = list_snapshot(opts.path) != 0;
                 goto cleanup;
         }
 
 cleanup:
         free(opts.path);
-        return 0;
+        free(opts.restore_path);
+        return ret;
 }
@@ -17,6 +17,12 @@ struct options {
         int discard;
         int list;
         int compare;
+        int diff;
+        int to;
+        int threads;
+        int stats;
+        int incremental;
+        char *restore_path;
         int version;
         int help;
 };
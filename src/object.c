@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include "config.h"
+#include "object.h"
+#include "delta.h"
+
+static const char object_magic[4] = { 'b', 'l', 'o', 'b' };
+static const char delta_magic[4] = { 'd', 'l', 't', 'a' };
+
+static void hash_to_hex(const unsigned char *hash, char *hex)
+{
+        for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+                sprintf(hex + i * 2, "%02x", hash[i]);
+        }
+}
+
+static int make_objects_root(void)
+{
+        char dir[PATH_MAX];
+
+        snprintf(dir, sizeof(dir), "%s/objects", config.revisions);
+        if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+                perror("mkdir");
+                return -1;
+        }
+
+        return 0;
+}
+
+static int make_object_dirs(const unsigned char *hash)
+{
+        char dir[PATH_MAX];
+
+        if (make_objects_root() != 0) return -1;
+
+        snprintf(dir, sizeof(dir), "%s/objects/%02x", config.revisions, hash[0]);
+        if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+                perror("mkdir");
+                return -1;
+        }
+
+        return 0;
+}
+
+int object_path(const unsigned char *hash, char *path, size_t len)
+{
+        char hex[SHA_DIGEST_LENGTH * 2 + 1];
+        hash_to_hex(hash, hex);
+
+        int n = snprintf(path, len, "%s/objects/%.2s/%s", config.revisions, hex, hex + 2);
+        if (n < 0 || (size_t)n >= len) return -1;
+
+        return 0;
+}
+
+/*
+ * Locks <config.revisions>/lock: shared by snapshots, which write objects
+ * and then refer to them, and exclusive for garbage collection, which must
+ * not see an object between those two steps. Returns the descriptor to
+ * pass to unlock_object_store().
+ */
+int lock_object_store(int exclusive)
+{
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/lock", config.revisions);
+
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+                perror("open");
+                return -1;
+        }
+
+        if (flock(fd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+                perror("flock");
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+void unlock_object_store(int fd)
+{
+        if (fd < 0) return;
+
+        flock(fd, LOCK_UN);
+        close(fd);
+}
+
+int object_exists(const unsigned char *hash)
+{
+        char path[PATH_MAX];
+        if (object_path(hash, path, sizeof(path)) != 0) return 0;
+
+        return access(path, F_OK) == 0;
+}
+
+/*
+ * Creates a uniquely named temporary file next to path, to be renamed over
+ * it once written. tmp_path needs room for path plus the ".XXXXXX" suffix.
+ */
+static int open_tmp_object(const char *path, char *tmp_path, size_t len)
+{
+        int n = snprintf(tmp_path, len, "%s.XXXXXX", path);
+        if (n < 0 || (size_t)n >= len) {
+                errno = ENAMETOOLONG;
+                perror("mkstemp");
+                return -1;
+        }
+
+        int fd = mkstemp(tmp_path);
+        if (fd < 0) {
+                perror("mkstemp");
+                return -1;
+        }
+        fchmod(fd, 0644);
+        return fd;
+}
+
+int write_object(const unsigned char *hash, const unsigned char *data, size_t size, size_t *stored_size)
+{
+        char path[PATH_MAX];
+        char tmp_path[PATH_MAX + 8];
+
+        if (object_path(hash, path, sizeof(path)) != 0) return -1;
+
+        struct stat st;
+        if (stat(path, &st) == 0) {
+                if (stored_size) *stored_size = st.st_size;
+                return 0;
+        }
+
+        if (make_object_dirs(hash) != 0) return -1;
+
+        const unsigned char *payload = data;
+        size_t payload_size = size;
+        unsigned char *compressed_data = NULL;
+        uint8_t compressed = 0;
+
+        if (config.compress_files && size > 0) {
+                uLong compressed_size = compressBound(size);
+                compressed_data = malloc(compressed_size);
+                if (!compressed_data) {
+                        perror("malloc");
+                        return -1;
+                }
+
+                if (compress(compressed_data, &compressed_size, data, size) != Z_OK) {
+                        free(compressed_data);
+                        return -1;
+                }
+
+                payload = compressed_data;
+                payload_size = compressed_size;
+                compressed = 1;
+        }
+
+        int fd = open_tmp_object(path, tmp_path, sizeof(tmp_path));
+        if (fd < 0) {
+                free(compressed_data);
+                return -1;
+        }
+
+        FILE *f = fdopen(fd, "wb");
+        if (!f) {
+                perror("fdopen");
+                close(fd);
+                unlink(tmp_path);
+                free(compressed_data);
+                return -1;
+        }
+
+        uint64_t raw_size = size;
+        if (fwrite(object_magic, sizeof(object_magic), 1, f) != 1 ||
+            fwrite(&compressed, sizeof(compressed), 1, f) != 1 ||
+            fwrite(&raw_size, sizeof(raw_size), 1, f) != 1 ||
+            fwrite(payload, 1, payload_size, f) != payload_size) {
+                perror("fwrite");
+                fclose(f);
+                unlink(tmp_path);
+                free(compressed_data);
+                return -1;
+        }
+
+        free(compressed_data);
+
+        if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+                perror("rename");
+                unlink(tmp_path);
+                return -1;
+        }
+
+        if (stored_size) {
+                *stored_size = sizeof(object_magic) + sizeof(compressed) + sizeof(raw_size) + payload_size;
+        }
+
+        return 0;
+}
+
+/*
+ * Streams src_path into the store in OBJECT_CHUNK_SIZE pieces: each chunk is
+ * hashed and deflated into a temporary object, which is renamed to its hash
+ * once the whole file has been read. Peak memory does not depend on the size
+ * of the file.
+ */
+int write_object_from_file(const char *src_path, unsigned char *hash, size_t *size, size_t *stored_size)
+{
+        char tmp_path[PATH_MAX];
+        char path[PATH_MAX];
+
+        FILE *src = fopen(src_path, "rb");
+        if (!src) {
+                perror("fopen");
+                return -1;
+        }
+
+        if (make_objects_root() != 0) {
+                fclose(src);
+                return -1;
+        }
+
+        snprintf(tmp_path, sizeof(tmp_path), "%s/objects/tmp_XXXXXX", config.revisions);
+        int fd = mkstemp(tmp_path);
+        if (fd < 0) {
+                perror("mkstemp");
+                fclose(src);
+                return -1;
+        }
+        fchmod(fd, 0644);
+
+        FILE *dst = fdopen(fd, "wb");
+        if (!dst) {
+                perror("fdopen");
+                close(fd);
+                unlink(tmp_path);
+                fclose(src);
+                return -1;
+        }
+
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) != 1) {
+                EVP_MD_CTX_free(ctx);
+                fclose(dst);
+                unlink(tmp_path);
+                fclose(src);
+                return -1;
+        }
+
+        uint8_t compressed = config.compress_files ? 1 : 0;
+        uint64_t raw_size = 0;
+        int failed = fwrite(object_magic, sizeof(object_magic), 1, dst) != 1 ||
+                     fwrite(&compressed, sizeof(compressed), 1, dst) != 1 ||
+                     fwrite(&raw_size, sizeof(raw_size), 1, dst) != 1;
+
+        z_stream strm = { 0 };
+        if (compressed && deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+                failed = 1;
+                compressed = 0;
+        }
+
+        unsigned char *src_buf = malloc(OBJECT_CHUNK_SIZE);
+        unsigned char *dst_buf = malloc(OBJECT_CHUNK_SIZE);
+        if (!src_buf || !dst_buf) {
+                perror("malloc");
+                failed = 1;
+        }
+
+        int ret = Z_OK;
+        while (!failed) {
+                size_t n = fread(src_buf, 1, OBJECT_CHUNK_SIZE, src);
+                if (ferror(src)) {
+                        perror("fread");
+                        failed = 1;
+                        break;
+                }
+
+                EVP_DigestUpdate(ctx, src_buf, n);
+                raw_size += n;
+
+                if (!compressed) {
+                        if (n > 0 && fwrite(src_buf, 1, n, dst) != n) failed = 1;
+                        if (feof(src)) break;
+                        continue;
+                }
+
+                strm.avail_in = n;
+                strm.next_in = src_buf;
+                do {
+                        strm.avail_out = OBJECT_CHUNK_SIZE;
+                        strm.next_out = dst_buf;
+                        ret = deflate(&strm, feof(src) ? Z_FINISH : Z_NO_FLUSH);
+                        size_t have = OBJECT_CHUNK_SIZE - strm.avail_out;
+                        if (fwrite(dst_buf, 1, have, dst) != have) {
+                                failed = 1;
+                                break;
+                        }
+                } while (strm.avail_out == 0);
+
+                if (ret == Z_STREAM_END) break;
+        }
+
+        if (compressed) deflateEnd(&strm);
+        free(src_buf);
+        free(dst_buf);
+        fclose(src);
+
+        EVP_DigestFinal_ex(ctx, hash, NULL);
+        EVP_MD_CTX_free(ctx);
+
+        // The final size is only known once the whole file has been read
+        if (!failed && (fseek(dst, sizeof(object_magic) + sizeof(compressed), SEEK_SET) != 0 ||
+                        fwrite(&raw_size, sizeof(raw_size), 1, dst) != 1 ||
+                        fseek(dst, 0, SEEK_END) != 0)) {
+                failed = 1;
+        }
+
+        long total = failed ? -1 : ftell(dst);
+        if (fclose(dst) != 0 || failed || total < 0) {
+                fprintf(stderr, "Failed to store object for %s\n", src_path);
+                unlink(tmp_path);
+                return -1;
+        }
+
+        *size = raw_size;
+        if (object_path(hash, path, sizeof(path)) != 0 || make_object_dirs(hash) != 0) {
+                unlink(tmp_path);
+                return -1;
+        }
+
+        struct stat st;
+        if (stat(path, &st) == 0) {
+                // Identical content is already stored
+                unlink(tmp_path);
+                total = st.st_size;
+        } else if (rename(tmp_path, path) != 0) {
+                perror("rename");
+                unlink(tmp_path);
+                return -1;
+        }
+
+        if (stored_size) *stored_size = total;
+        return 0;
+}
+
+static int copy_stream(FILE *src, FILE *dst)
+{
+        unsigned char buf[16384];
+        size_t n;
+
+        while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
+                if (fwrite(buf, 1, n, dst) != n) return -1;
+        }
+        return ferror(src) ? -1 : 0;
+}
+
+static int deflate_stream(FILE *src, FILE *dst)
+{
+        z_stream strm = { 0 };
+        if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) return -1;
+
+        unsigned char src_buf[16384];
+        unsigned char dst_buf[16384];
+        int ret;
+
+        do {
+                strm.avail_in = fread(src_buf, 1, sizeof(src_buf), src);
+                if (ferror(src)) {
+                        deflateEnd(&strm);
+                        return -1;
+                }
+                strm.next_in = src_buf;
+
+                do {
+                        strm.avail_out = sizeof(dst_buf);
+                        strm.next_out = dst_buf;
+                        ret = deflate(&strm, feof(src) ? Z_FINISH : Z_NO_FLUSH);
+                        size_t have = sizeof(dst_buf) - strm.avail_out;
+                        if (fwrite(dst_buf, 1, have, dst) != have) {
+                                deflateEnd(&strm);
+                                return -1;
+                        }
+                } while (strm.avail_out == 0);
+        } while (ret != Z_STREAM_END);
+
+        deflateEnd(&strm);
+        return 0;
+}
+
+static FILE *open_object(const unsigned char *hash, struct object_header *hdr)
+{
+        char path[PATH_MAX];
+        if (object_path(hash, path, sizeof(path)) != 0) return NULL;
+
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+                perror("fopen");
+                return NULL;
+        }
+
+        char magic[sizeof(object_magic)];
+        if (fread(magic, sizeof(magic), 1, f) != 1 ||
+            fread(&hdr->compressed, sizeof(hdr->compressed), 1, f) != 1 ||
+            fread(&hdr->raw_size, sizeof(hdr->raw_size), 1, f) != 1) {
+                fprintf(stderr, "Corrupt object: %s\n", path);
+                fclose(f);
+                return NULL;
+        }
+
+        hdr->is_delta = memcmp(magic, delta_magic, sizeof(magic)) == 0;
+        if (!hdr->is_delta && memcmp(magic, object_magic, sizeof(magic)) != 0) {
+                fprintf(stderr, "Corrupt object: %s\n", path);
+                fclose(f);
+                return NULL;
+        }
+
+        if (hdr->is_delta && fread(hdr->base_hash, SHA_DIGEST_LENGTH, 1, f) != 1) {
+                fprintf(stderr, "Corrupt object: %s\n", path);
+                fclose(f);
+                return NULL;
+        }
+
+        struct stat st;
+        hdr->stored_size = fstat(fileno(f), &st) == 0 ? (size_t)st.st_size : 0;
+        return f;
+}
+
+int read_object_header(const unsigned char *hash, struct object_header *hdr)
+{
+        FILE *f = open_object(hash, hdr);
+        if (!f) return -1;
+
+        fclose(f);
+        return 0;
+}
+
+// Copies the rest of src to dst, inflating it when compressed is set
+static int copy_payload(FILE *src, int compressed, FILE *dst, uint64_t *written)
+{
+        unsigned char *src_buf = malloc(OBJECT_CHUNK_SIZE);
+        unsigned char *dst_buf = malloc(OBJECT_CHUNK_SIZE);
+        int failed = !src_buf || !dst_buf;
+        *written = 0;
+
+        z_stream strm = { 0 };
+        if (!failed && compressed && inflateInit(&strm) != Z_OK) {
+                failed = 1;
+                compressed = 0;
+        }
+
+        int ret = Z_OK;
+        while (!failed && ret != Z_STREAM_END) {
+                size_t n = fread(src_buf, 1, OBJECT_CHUNK_SIZE, src);
+                if (ferror(src)) {
+                        failed = 1;
+                        break;
+                }
+
+                if (!compressed) {
+                        if (fwrite(src_buf, 1, n, dst) != n) failed = 1;
+                        *written += n;
+                        if (n == 0) break;
+                        continue;
+                }
+
+                if (n == 0) {
+                        // Truncated stream
+                        failed = 1;
+                        break;
+                }
+
+                strm.avail_in = n;
+                strm.next_in = src_buf;
+                do {
+                        strm.avail_out = OBJECT_CHUNK_SIZE;
+                        strm.next_out = dst_buf;
+                        ret = inflate(&strm, Z_NO_FLUSH);
+                        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                                failed = 1;
+                                break;
+                        }
+                        size_t have = OBJECT_CHUNK_SIZE - strm.avail_out;
+                        if (fwrite(dst_buf, 1, have, dst) != have) {
+                                failed = 1;
+                                break;
+                        }
+                        *written += have;
+                } while (strm.avail_out == 0);
+        }
+
+        if (compressed) inflateEnd(&strm);
+        free(src_buf);
+        free(dst_buf);
+        return failed ? -1 : 0;
+}
+
+// Rebuilds a delta object: materializes its base, then replays the copy/insert stream
+static int copy_delta_object(FILE *src, const struct object_header *hdr, FILE *dst)
+{
+        FILE *ops = tmpfile();
+        FILE *base = tmpfile();
+        uint64_t ops_size;
+        int ret = -1;
+
+        if (!ops || !base) {
+                perror("tmpfile");
+                goto out;
+        }
+
+        if (copy_payload(src, hdr->compressed, ops, &ops_size) != 0 ||
+            copy_object_to_file(hdr->base_hash, base) != 0 ||
+            fflush(base) != 0) {
+                goto out;
+        }
+
+        rewind(ops);
+        ret = apply_file_delta(fileno(base), ops, dst);
+
+out:
+        if (ops) fclose(ops);
+        if (base) fclose(base);
+        return ret;
+}
+
+/*
+ * Writes the contents of an object to dst without holding more than one
+ * chunk of it in memory, mirroring inflate_file() in fs.c. Delta objects
+ * are rebuilt from their base.
+ */
+int copy_object_to_file(const unsigned char *hash, FILE *dst)
+{
+        struct object_header hdr;
+        FILE *src = open_object(hash, &hdr);
+        if (!src) return -1;
+
+        long start = ftell(dst);
+        uint64_t written = 0;
+        int ret;
+
+        if (hdr.is_delta) {
+                ret = copy_delta_object(src, &hdr, dst);
+                if (ret == 0 && start >= 0) written = ftell(dst) - start;
+        } else {
+                ret = copy_payload(src, hdr.compressed, dst, &written);
+        }
+        fclose(src);
+
+        if (ret != 0 || (start >= 0 && written != hdr.raw_size)) {
+                fprintf(stderr, "Failed to read object: ");
+                for (int i = 0; i < SHA_DIGEST_LENGTH; i++) fprintf(stderr, "%02x", hash[i]);
+                fprintf(stderr, "\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+int read_object(const unsigned char *hash, unsigned char **data, size_t *size)
+{
+        char *buf = NULL;
+        size_t len = 0;
+
+        FILE *mem = open_memstream(&buf, &len);
+        if (!mem) {
+                perror("open_memstream");
+                return -1;
+        }
+
+        int ret = copy_object_to_file(hash, mem);
+        fclose(mem);
+
+        if (ret != 0) {
+                free(buf);
+                return -1;
+        }
+
+        *data = (unsigned char *)buf;
+        *size = len;
+        return 0;
+}
+
+/*
+ * Replaces the full object for hash by a delta against base_hash whose
+ * copy/insert stream is in ops, but only if that saves at least a quarter
+ * of the stored size. Returns 1 if replaced, 0 if the full object is kept.
+ */
+int write_delta_object(const unsigned char *hash, const unsigned char *base_hash,
+                       FILE *ops, size_t raw_size, size_t *stored_size)
+{
+        char path[PATH_MAX];
+        char tmp_path[PATH_MAX + 8];
+        struct stat st;
+
+        if (object_path(hash, path, sizeof(path)) != 0 || stat(path, &st) != 0) return -1;
+
+        int fd = open_tmp_object(path, tmp_path, sizeof(tmp_path));
+        if (fd < 0) return -1;
+
+        FILE *dst = fdopen(fd, "wb");
+        if (!dst) {
+                perror("fdopen");
+                close(fd);
+                unlink(tmp_path);
+                return -1;
+        }
+
+        uint8_t compressed = config.compress_files ? 1 : 0;
+        uint64_t size = raw_size;
+        int failed = fwrite(delta_magic, sizeof(delta_magic), 1, dst) != 1 ||
+                     fwrite(&compressed, sizeof(compressed), 1, dst) != 1 ||
+                     fwrite(&size, sizeof(size), 1, dst) != 1 ||
+                     fwrite(base_hash, SHA_DIGEST_LENGTH, 1, dst) != 1;
+
+        rewind(ops);
+        if (!failed) {
+                failed = compressed ? deflate_stream(ops, dst) != 0 : copy_stream(ops, dst) != 0;
+        }
+
+        long total = failed ? -1 : ftell(dst);
+        if (fclose(dst) != 0 || failed || total < 0) {
+                unlink(tmp_path);
+                return -1;
+        }
+
+        if ((size_t)total * 4 > (size_t)st.st_size * 3) {
+                unlink(tmp_path);
+                if (stored_size) *stored_size = st.st_size;
+                return 0;
+        }
+
+        if (rename(tmp_path, path) != 0) {
+                perror("rename");
+                unlink(tmp_path);
+                return -1;
+        }
+
+        if (stored_size) *stored_size = total;
+        return 1;
+}
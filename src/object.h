@@ -0,0 +1,36 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <openssl/sha.h>
+
+/*
+ * Content-addressed object store shared by every snapshotted directory.
+ * Objects live under <config.revisions>/objects/xx/yyyy..., keyed by the
+ * SHA1 of the uncompressed file contents.
+ */
+
+#define OBJECT_CHUNK_SIZE (256 * 1024)
+
+struct object_header {
+        int is_delta;
+        unsigned char compressed;
+        unsigned long long raw_size;
+        unsigned char base_hash[SHA_DIGEST_LENGTH];
+        size_t stored_size;
+};
+
+int object_path(const unsigned char *hash, char *path, size_t len);
+int object_exists(const unsigned char *hash);
+int lock_object_store(int exclusive);
+void unlock_object_store(int fd);
+int write_object(const unsigned char *hash, const unsigned char *data, size_t size, size_t *stored_size);
+int read_object(const unsigned char *hash, unsigned char **data, size_t *size);
+int write_object_from_file(const char *src_path, unsigned char *hash, size_t *size, size_t *stored_size);
+int copy_object_to_file(const unsigned char *hash, FILE *dst);
+int read_object_header(const unsigned char *hash, struct object_header *hdr);
+int write_delta_object(const unsigned char *hash, const unsigned char *base_hash,
+                       FILE *ops, size_t raw_size, size_t *stored_size);
+
+#endif
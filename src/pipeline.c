@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include "tree.h"
+#include "index.h"
+#include "object.h"
+#include "pipeline.h"
+
+// Larger files bypass the queues and are streamed by the reader itself
+#define STREAM_THRESHOLD (8 * 1024 * 1024)
+
+struct queue {
+        const char *name;
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+        void **items;
+        size_t capacity;
+        size_t head;
+        size_t count;
+        int closed;
+        size_t max_depth;
+        size_t pushes;
+        size_t depth_sum;
+        size_t full_waits;
+};
+
+struct blob_job {
+        char *path;
+        char *rel_path;
+        struct stat st;
+        struct tree_entry *entry;
+        struct index *idx;
+        unsigned char *data;
+        size_t size;
+};
+
+struct stage {
+        struct pipeline *pipeline;
+        pthread_t *threads;
+        int thread_count;
+        int configured;
+};
+
+struct pipeline {
+        struct queue read_queue;
+        struct queue hash_queue;
+        struct queue compress_queue;
+        struct stage readers;
+        struct stage hashers;
+        struct stage compressors;
+        pthread_mutex_t lock;
+        size_t failures;
+};
+
+static int queue_init(struct queue *q, const char *name, size_t capacity)
+{
+        memset(q, 0, sizeof(*q));
+        q->items = malloc(capacity * sizeof(void *));
+        if (!q->items) {
+                perror("malloc");
+                return -1;
+        }
+
+        q->name = name;
+        q->capacity = capacity;
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->not_empty, NULL);
+        pthread_cond_init(&q->not_full, NULL);
+        return 0;
+}
+
+static void queue_destroy(struct queue *q)
+{
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->not_empty);
+        pthread_cond_destroy(&q->not_full);
+        free(q->items);
+}
+
+static void queue_push(struct queue *q, void *item)
+{
+        pthread_mutex_lock(&q->lock);
+
+        if (q->count == q->capacity) {
+                q->full_waits++;
+                while (q->count == q->capacity) {
+                        pthread_cond_wait(&q->not_full, &q->lock);
+                }
+        }
+
+        q->items[(q->head + q->count) % q->capacity] = item;
+        q->count++;
+        q->pushes++;
+        q->depth_sum += q->count;
+        if (q->count > q->max_depth) {
+                q->max_depth = q->count;
+        }
+
+        pthread_cond_signal(&q->not_empty);
+        pthread_mutex_unlock(&q->lock);
+}
+
+// Returns NULL once the queue is closed and drained
+static void *queue_pop(struct queue *q)
+{
+        void *item = NULL;
+
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->closed) {
+                pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+
+        if (q->count > 0) {
+                item = q->items[q->head];
+                q->head = (q->head + 1) % q->capacity;
+                q->count--;
+                pthread_cond_signal(&q->not_full);
+        }
+
+        pthread_mutex_unlock(&q->lock);
+        return item;
+}
+
+static void queue_close(struct queue *q)
+{
+        pthread_mutex_lock(&q->lock);
+        q->closed = 1;
+        pthread_cond_broadcast(&q->not_empty);
+        pthread_mutex_unlock(&q->lock);
+}
+
+static void free_job(struct blob_job *job)
+{
+        free(job->data);
+        free(job->path);
+        free(job->rel_path);
+        free(job);
+}
+
+// Drops the blob so finish_tree() removes the entry, as the serial scan would
+static void fail_job(struct pipeline *p, struct blob_job *job)
+{
+        free_blob(job->entry->blob);
+        job->entry->blob = NULL;
+
+        pthread_mutex_lock(&p->lock);
+        p->failures++;
+        pthread_mutex_unlock(&p->lock);
+
+        free_job(job);
+}
+
+static void complete_job(struct blob_job *job)
+{
+        struct blob *blob = job->entry->blob;
+        index_update(job->idx, job->rel_path, &job->st, blob->hash, blob->compressed_size);
+        free_job(job);
+}
+
+static void *reader_main(void *arg)
+{
+        struct pipeline *p = ((struct stage *)arg)->pipeline;
+        struct blob_job *job;
+
+        while ((job = queue_pop(&p->read_queue)) != NULL) {
+                if (job->st.st_size > STREAM_THRESHOLD) {
+                        struct blob *blob = job->entry->blob;
+                        if (write_object_from_file(job->path, blob->hash, &blob->size,
+                                                   &blob->compressed_size) != 0) {
+                                fail_job(p, job);
+                        } else {
+                                complete_job(job);
+                        }
+                        continue;
+                }
+
+                FILE *file = fopen(job->path, "rb");
+                if (!file) {
+                        perror("fopen");
+                        fail_job(p, job);
+                        continue;
+                }
+
+                job->size = job->st.st_size;
+                job->data = malloc(job->size ? job->size : 1);
+                if (!job->data || fread(job->data, 1, job->size, file) != job->size) {
+                        perror("fread");
+                        fclose(file);
+                        fail_job(p, job);
+                        continue;
+                }
+                fclose(file);
+
+                queue_push(&p->hash_queue, job);
+        }
+
+        return NULL;
+}
+
+static void *hasher_main(void *arg)
+{
+        struct pipeline *p = ((struct stage *)arg)->pipeline;
+        struct blob_job *job;
+
+        while ((job = queue_pop(&p->hash_queue)) != NULL) {
+                struct blob *blob = job->entry->blob;
+
+                SHA1(job->data, job->size, blob->hash);
+                blob->size = job->size;
+
+                // Content already stored by an earlier snapshot or another file
+                char path[PATH_MAX];
+                struct stat st;
+                if (object_path(blob->hash, path, sizeof(path)) == 0 && stat(path, &st) == 0) {
+                        blob->compressed_size = st.st_size;
+                        complete_job(job);
+                        continue;
+                }
+
+                queue_push(&p->compress_queue, job);
+        }
+
+        return NULL;
+}
+
+static void *compressor_main(void *arg)
+{
+        struct pipeline *p = ((struct stage *)arg)->pipeline;
+        struct blob_job *job;
+
+        while ((job = queue_pop(&p->compress_queue)) != NULL) {
+                struct blob *blob = job->entry->blob;
+
+                if (write_object(blob->hash, job->data, job->size, &blob->compressed_size) != 0) {
+                        fprintf(stderr, "Failed to store object for %s\n", job->path);
+                        fail_job(p, job);
+                        continue;
+                }
+
+                complete_job(job);
+        }
+
+        return NULL;
+}
+
+static int start_stage(struct pipeline *p, struct stage *stage, int count, void *(*fn)(void *))
+{
+        stage->pipeline = p;
+        stage->configured = count;
+        stage->threads = calloc(count, sizeof(pthread_t));
+        if (!stage->threads) {
+                perror("calloc");
+                return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+                if (pthread_create(&stage->threads[i], NULL, fn, stage) != 0) {
+                        perror("pthread_create");
+                        return -1;
+                }
+                stage->thread_count++;
+        }
+        return 0;
+}
+
+static void join_stage(struct stage *stage)
+{
+        for (int i = 0; i < stage->thread_count; i++) {
+                pthread_join(stage->threads[i], NULL);
+        }
+        stage->thread_count = 0;
+}
+
+struct pipeline *pipeline_create(int readers, int hashers, int compressors, size_t depth)
+{
+        struct pipeline *p = calloc(1, sizeof(struct pipeline));
+        if (!p) {
+                perror("calloc");
+                return NULL;
+        }
+
+        if (depth < 1) depth = 1;
+        pthread_mutex_init(&p->lock, NULL);
+
+        if (queue_init(&p->read_queue, "read", depth) != 0 ||
+            queue_init(&p->hash_queue, "hash", depth) != 0 ||
+            queue_init(&p->compress_queue, "compress", depth) != 0 ||
+            start_stage(p, &p->readers, readers > 0 ? readers : 1, reader_main) != 0 ||
+            start_stage(p, &p->hashers, hashers > 0 ? hashers : 1, hasher_main) != 0 ||
+            start_stage(p, &p->compressors, compressors > 0 ? compressors : 1, compressor_main) != 0) {
+                pipeline_finish(p);
+                pipeline_destroy(p);
+                return NULL;
+        }
+
+        return p;
+}
+
+/*
+ * Queues a regular file whose entry already holds a blob filled from stat
+ * data. The hash and stored size are filled in by the pipeline; blocks while
+ * the read queue is full.
+ */
+int pipeline_submit(struct pipeline *p, const char *path, const char *rel_path,
+                    const struct stat *st, struct tree_entry *entry, struct index *idx)
+{
+        struct blob_job *job = calloc(1, sizeof(struct blob_job));
+        if (!job) {
+                perror("calloc");
+                return -1;
+        }
+
+        job->path = strdup(path);
+        job->rel_path = strdup(rel_path);
+        if (!job->path || !job->rel_path) {
+                free_job(job);
+                return -1;
+        }
+
+        job->st = *st;
+        job->entry = entry;
+        job->idx = idx;
+
+        queue_push(&p->read_queue, job);
+        return 0;
+}
+
+// Drains every stage in order; returns the number of files that failed
+int pipeline_finish(struct pipeline *p)
+{
+        queue_close(&p->read_queue);
+        join_stage(&p->readers);
+        queue_close(&p->hash_queue);
+        join_stage(&p->hashers);
+        queue_close(&p->compress_queue);
+        join_stage(&p->compressors);
+
+        return (int)p->failures;
+}
+
+static void print_queue_stats(const struct queue *q, FILE *out)
+{
+        fprintf(out, "  %-8s queue: depth max %zu/%zu avg %.1f, %zu items, %zu full stalls\n",
+                q->name, q->max_depth, q->capacity,
+                q->pushes ? (double)q->depth_sum / q->pushes : 0.0,
+                q->pushes, q->full_waits);
+}
+
+void pipeline_print_stats(struct pipeline *p, FILE *out)
+{
+        fprintf(out, "Pipeline: %d readers, %d hashers, %d compressors\n",
+                p->readers.configured, p->hashers.configured, p->compressors.configured);
+        print_queue_stats(&p->read_queue, out);
+        print_queue_stats(&p->hash_queue, out);
+        print_queue_stats(&p->compress_queue, out);
+}
+
+void pipeline_destroy(struct pipeline *p)
+{
+        if (!p) return;
+
+        queue_destroy(&p->read_queue);
+        queue_destroy(&p->hash_queue);
+        queue_destroy(&p->compress_queue);
+        free(p->readers.threads);
+        free(p->hashers.threads);
+        free(p->compressors.threads);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+}
@@ -0,0 +1,25 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+/*
+ * Blob ingestion pipeline: reader threads load file contents, hasher threads
+ * compute the content hash and drop objects already in the store, and
+ * compressor threads compress and write the remaining objects. Stages are
+ * connected by bounded queues, so memory use is capped by the queue depth.
+ */
+
+struct tree_entry;
+struct index;
+struct pipeline;
+
+struct pipeline *pipeline_create(int readers, int hashers, int compressors, size_t depth);
+int pipeline_submit(struct pipeline *p, const char *path, const char *rel_path,
+                    const struct stat *st, struct tree_entry *entry, struct index *idx);
+int pipeline_finish(struct pipeline *p);
+void pipeline_print_stats(struct pipeline *p, FILE *out);
+void pipeline_destroy(struct pipeline *p);
+
+#endif
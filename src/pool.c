@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "pool.h"
+
+struct task {
+        task_fn fn;
+        void *arg;
+};
+
+struct worker {
+        struct pool *pool;
+        int id;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        struct task *tasks;
+        size_t head;
+        size_t tail;
+        size_t capacity;
+};
+
+struct pool {
+        int thread_count;
+        struct worker *workers;
+        pthread_mutex_t lock;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        atomic_size_t queued;
+        atomic_size_t pending;
+        atomic_uint next_worker;
+        int shutdown;
+};
+
+static __thread struct worker *current_worker;
+
+static int push_task(struct worker *w, struct task task)
+{
+        pthread_mutex_lock(&w->lock);
+
+        if (w->tail == w->capacity) {
+                if (w->head > 0) {
+                        memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(struct task));
+                        w->tail -= w->head;
+                        w->head = 0;
+                } else {
+                        size_t capacity = w->capacity ? w->capacity * 2 : 64;
+                        struct task *tasks = realloc(w->tasks, capacity * sizeof(struct task));
+                        if (!tasks) {
+                                pthread_mutex_unlock(&w->lock);
+                                perror("realloc");
+                                return -1;
+                        }
+                        w->tasks = tasks;
+                        w->capacity = capacity;
+                }
+        }
+
+        w->tasks[w->tail++] = task;
+        pthread_mutex_unlock(&w->lock);
+        return 0;
+}
+
+// Owner end: newest task first, keeps the working set of a subtree hot
+static int pop_task(struct worker *w, struct task *task)
+{
+        int found = 0;
+
+        pthread_mutex_lock(&w->lock);
+        if (w->tail > w->head) {
+                *task = w->tasks[--w->tail];
+                found = 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+        return found;
+}
+
+// Thief end: oldest task first, which tends to be the largest unit of work
+static int steal_task(struct worker *w, struct task *task)
+{
+        int found = 0;
+
+        pthread_mutex_lock(&w->lock);
+        if (w->tail > w->head) {
+                *task = w->tasks[w->head++];
+                found = 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+        return found;
+}
+
+static int find_task(struct worker *self, struct task *task)
+{
+        struct pool *pool = self->pool;
+
+        if (pop_task(self, task)) return 1;
+
+        for (int i = 1; i < pool->thread_count; i++) {
+                struct worker *victim = &pool->workers[(self->id + i) % pool->thread_count];
+                if (steal_task(victim, task)) return 1;
+        }
+
+        return 0;
+}
+
+static void *worker_main(void *arg)
+{
+        struct worker *self = arg;
+        struct pool *pool = self->pool;
+        struct task task;
+
+        current_worker = self;
+
+        while (1) {
+                if (find_task(self, &task)) {
+                        atomic_fetch_sub(&pool->queued, 1);
+                        task.fn(task.arg);
+
+                        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                                pthread_mutex_lock(&pool->lock);
+                                pthread_cond_broadcast(&pool->done_cond);
+                                pthread_mutex_unlock(&pool->lock);
+                        }
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                while (atomic_load(&pool->queued) == 0 && !pool->shutdown) {
+                        pthread_cond_wait(&pool->work_cond, &pool->lock);
+                }
+                int done = pool->shutdown && atomic_load(&pool->queued) == 0;
+                pthread_mutex_unlock(&pool->lock);
+
+                if (done) break;
+        }
+
+        return NULL;
+}
+
+struct pool *pool_create(int threads)
+{
+        if (threads < 1) threads = 1;
+
+        struct pool *pool = calloc(1, sizeof(struct pool));
+        if (!pool) {
+                perror("calloc");
+                return NULL;
+        }
+
+        pool->workers = calloc(threads, sizeof(struct worker));
+        if (!pool->workers) {
+                perror("calloc");
+                free(pool);
+                return NULL;
+        }
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work_cond, NULL);
+        pthread_cond_init(&pool->done_cond, NULL);
+        atomic_init(&pool->queued, 0);
+        atomic_init(&pool->pending, 0);
+        atomic_init(&pool->next_worker, 0);
+
+        for (int i = 0; i < threads; i++) {
+                pool->workers[i].pool = pool;
+                pool->workers[i].id = i;
+                pthread_mutex_init(&pool->workers[i].lock, NULL);
+        }
+
+        // Set before any worker runs, as workers read it to pick steal victims
+        pool->thread_count = threads;
+
+        for (int i = 0; i < threads; i++) {
+                if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+                        perror("pthread_create");
+                        pool->thread_count = i;
+                        pool_destroy(pool);
+                        return NULL;
+                }
+        }
+
+        return pool;
+}
+
+int pool_submit(struct pool *pool, task_fn fn, void *arg)
+{
+        struct task task = { .fn = fn, .arg = arg };
+        struct worker *target = current_worker;
+
+        if (!target || target->pool != pool) {
+                unsigned n = atomic_fetch_add(&pool->next_worker, 1);
+                target = &pool->workers[n % pool->thread_count];
+        }
+
+        atomic_fetch_add(&pool->pending, 1);
+        atomic_fetch_add(&pool->queued, 1);
+        if (push_task(target, task) != 0) {
+                atomic_fetch_sub(&pool->queued, 1);
+                atomic_fetch_sub(&pool->pending, 1);
+                return -1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+}
+
+void pool_wait(struct pool *pool)
+{
+        pthread_mutex_lock(&pool->lock);
+        while (atomic_load(&pool->pending) > 0) {
+                pthread_cond_wait(&pool->done_cond, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool *pool)
+{
+        if (!pool) return;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->thread_count; i++) {
+                pthread_join(pool->workers[i].thread, NULL);
+        }
+
+        for (int i = 0; i < pool->thread_count; i++) {
+                pthread_mutex_destroy(&pool->workers[i].lock);
+                free(pool->workers[i].tasks);
+        }
+
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->work_cond);
+        pthread_cond_destroy(&pool->done_cond);
+        free(pool->workers);
+        free(pool);
+}
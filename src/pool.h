@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Work-stealing thread pool. Each worker owns a deque: it pushes and pops
+ * its own tasks LIFO and, when idle, steals the oldest task of another
+ * worker. Tasks may submit further tasks; pool_wait() returns once every
+ * task, including those spawned by other tasks, has finished.
+ */
+
+typedef void (*task_fn)(void *arg);
+
+struct pool;
+
+struct pool *pool_create(int threads);
+int pool_submit(struct pool *pool, task_fn fn, void *arg);
+void pool_wait(struct pool *pool);
+void pool_destroy(struct pool *pool);
+
+#endif
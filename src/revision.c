@@ -2,13 +2,161 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "revision.h"
 #include "delta.h"
 #include "tree.h"
+#include "index.h"
+#include "buffer.h"
+#include "catalog.h"
+#include "config.h"
+
+#define REVISION_FORMAT_VERSION 3
+// Format 2 deltas have no nested subdirectory records but decode unchanged
+#define REVISION_MIN_FORMAT_VERSION 2
+#define DEFAULT_KEYFRAME_INTERVAL 16
+
+static const char revision_magic[4] = { 'S', 'V', 'D', 'R' };
+
+/*
+ * Scans dir_path using the stat cache kept in rev_dir, then writes the
+ * refreshed cache back for the next snapshot.
+ */
+static struct tree *scan_directory(const char *rev_dir, const char *dir_path)
+{
+        char index_path[PATH_MAX];
+        snprintf(index_path, sizeof(index_path), "%s/index", rev_dir);
+
+        struct index *idx = load_index(index_path);
+        struct tree *tree = form_tree(dir_path, idx);
+
+        if (tree && idx && save_index(idx, index_path) != 0) {
+                fprintf(stderr, "Failed to save index: %s\n", index_path);
+        }
+
+        free_index(idx);
+        return tree;
+}
+
+static void count_tree(const struct tree *tree, uint64_t *entries, uint64_t *bytes)
+{
+        for (const struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                (*entries)++;
+                if (entry->subtree) count_tree(entry->subtree, entries, bytes);
+                if (entry->blob) *bytes += entry->blob->size;
+        }
+}
+
+/*
+ * Counts the entries rev changed since the revision before it. Forward
+ * deltas, and keyframes that still carry the delta they were made from,
+ * say so directly; a reverse delta runs the other way and only says how
+ * the next revision differs.
+ */
+static void count_changes(const struct revision *rev, struct catalog_record *record)
+{
+        record->added = record->removed = record->modified = 0;
+
+        if (rev->delta && rev->base_version < rev->version) {
+                count_tree_delta(rev->delta, &record->added, &record->removed, &record->modified);
+        } else if (rev->version == 0 && rev->base_version == -1) {
+                record->added = rev->entry_count;
+        } else {
+                record->added = record->removed = record->modified = CATALOG_UNKNOWN;
+        }
+}
+
+// Highest N for which rev_dir holds a revision_N file, or -1 if there is none
+static int last_revision_file(const char *rev_dir)
+{
+        DIR *dir = opendir(rev_dir);
+        if (!dir) return -1;
+
+        int last = -1;
+        struct dirent *d;
+        while ((d = readdir(dir)) != NULL) {
+                const char *digits = d->d_name + strlen("revision_");
+                if (strncmp(d->d_name, "revision_", strlen("revision_")) != 0 || !*digits ||
+                    strspn(digits, "0123456789") != strlen(digits)) {
+                        continue;
+                }
+
+                int version = atoi(digits);
+                if (version > last) last = version;
+        }
+
+        closedir(dir);
+        return last;
+}
+
+/*
+ * Opens the catalog of rev_dir. Directories snapshotted before the catalog
+ * existed get one built from their revision files, once. If some revision
+ * file cannot be read the catalog is neither written nor returned: an
+ * empty or short catalog would have the next snapshot overwrite revisions.
+ */
+static struct catalog *open_catalog(const char *rev_dir)
+{
+        struct catalog *cat = load_catalog(rev_dir);
+        if (!cat || cat->count > 0) return cat;
+
+        int last = last_revision_file(rev_dir);
+        if (last < 0) return cat;
+
+        struct catalog_record *records = calloc(last + 1, sizeof(*records));
+        if (!records) {
+                perror("calloc");
+                free_catalog(cat);
+                return NULL;
+        }
 
-struct revision *create_base_revision(const char *dir_path) 
+        int ret = 0;
+        for (int version = 0; version <= last; version++) {
+                char rev_path[PATH_MAX];
+                snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, version);
+
+                struct stat st;
+                struct revision *rev = stat(rev_path, &st) == 0 ? load_revision_from_file(rev_path) : NULL;
+                if (!rev || rev->version != version) {
+                        fprintf(stderr, "Cannot rebuild the catalog of %s: revision %d is unreadable\n",
+                                rev_dir, version);
+                        free_revision(rev);
+                        ret = -1;
+                        break;
+                }
+
+                struct catalog_record *record = &records[version];
+                record->version = rev->version;
+                record->parent = rev->base_version;
+                record->timestamp = st.st_mtime;
+                record->entry_count = rev->entry_count;
+                record->raw_size = rev->raw_size;
+                record->stored_size = st.st_size;
+                record->offset = rev->body_offset;
+                memcpy(record->hash, rev->hash, SHA_DIGEST_LENGTH);
+                count_changes(rev, record);
+                free_revision(rev);
+        }
+
+        for (int version = 0; ret == 0 && version <= last; version++) {
+                ret = catalog_append(cat, &records[version]);
+        }
+
+        free(records);
+        if (ret != 0) {
+                free_catalog(cat);
+                return NULL;
+        }
+        return cat;
+}
+
+struct revision *create_base_revision(const char *rev_dir, const char *dir_path) 
 {
         struct revision *rev = malloc(sizeof(struct revision));
         if (!rev) {
@@ -17,7 +165,7 @@ struct revision *create_base_revision(const char *dir_path)
         }
 
         rev->version = 0;
-        rev->base_tree = form_tree(dir_path);
+        rev->base_tree = scan_directory(rev_dir, dir_path);
         if (!rev->base_tree) {
                 free(rev);
                 return NULL;
@@ -25,48 +173,50 @@ struct revision *create_base_revision(const char *dir_path)
 
         rev->delta = NULL;
         rev->base_version = -1;
+        rev->entry_count = 0;
+        rev->raw_size = 0;
+        count_tree(rev->base_tree, &rev->entry_count, &rev->raw_size);
 
-        // Calculate hash of the tree
-        FILE *tmp = tmpfile();
-        if (!tmp) {
-                free_tree(rev->base_tree);
-                free(rev);
-                return NULL;
-        }
+        // The Merkle root of the tree identifies the revision
+        memcpy(rev->hash, rev->base_tree->hash, SHA_DIGEST_LENGTH);
 
-        if (serialize_tree(tmp, rev->base_tree) != 0) {
-                fclose(tmp);
-                free_tree(rev->base_tree);
-                free(rev);
-                return NULL;
+        return rev;
+}
+
+/*
+ * A new revision is stored as a keyframe once the delta chain behind its
+ * parent is keyframe_interval long, or once the deltas in it add up to more
+ * than max_chain_kb (by default, more than the keyframe itself).
+ */
+static int needs_keyframe(const struct catalog *cat, int parent)
+{
+        int interval = config.keyframe_interval > 0 ? config.keyframe_interval : DEFAULT_KEYFRAME_INTERVAL;
+        uint64_t chain_bytes = 0;
+        int chain_len = 1;
+
+        const struct catalog_record *record = catalog_find(cat, parent);
+        while (record && record->parent != -1) {
+                chain_bytes += record->stored_size;
+                chain_len++;
+                record = catalog_find(cat, record->parent);
         }
+        if (!record) return 1;
 
-        fseek(tmp, 0, SEEK_END);
-        size_t size = ftell(tmp);
-        fseek(tmp, 0, SEEK_SET);
+        uint64_t limit = config.max_chain_kb > 0 ? (uint64_t)config.max_chain_kb * 1024 : record->stored_size;
+        return chain_len >= interval || chain_bytes > limit;
+}
 
-        unsigned char *buffer = malloc(size);
-        if (!buffer) {
-                fclose(tmp);
-                free_tree(rev->base_tree);
-                free(rev);
-                return NULL;
+static void store_file_deltas(struct tree_delta *delta)
+{
+        for (struct tree_entry *entry = delta->modified_entries; entry; entry = entry->next) {
+                if (store_file_delta(entry) != 0) {
+                        fprintf(stderr, "Keeping full copy of %s\n", entry->name);
+                }
         }
 
-        if (fread(buffer, 1, size, tmp) != size) {
-                free(buffer);
-                fclose(tmp);
-                free_tree(rev->base_tree);
-                free(rev);
-                return NULL;
+        for (struct subtree_delta *sub = delta->subtrees; sub; sub = sub->next) {
+                store_file_deltas(sub->delta);
         }
-
-        SHA1(buffer, size, rev->hash);
-
-        free(buffer);
-        fclose(tmp);
-
-        return rev;
 }
 
 struct revision *create_delta_revision(const char *rev_dir, struct revision *base, const char *current_dir) 
@@ -79,25 +229,23 @@ struct revision *create_delta_revision(const char *rev_dir, struct revision *bas
                 return NULL;
         }
 
-        struct tree *current_tree = form_tree(current_dir);
+        struct tree *current_tree = scan_directory(rev_dir, current_dir);
         if (!current_tree) {
                 free(rev);
                 return NULL;
         }
 
-        int next_version = 1;
-        char rev_path[PATH_MAX];
-        while (1) {
-                snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, next_version);
-                FILE *test = fopen(rev_path, "r");
-                if (test == NULL) {
-                        break;
-                }
-                fclose(test);
-                next_version++;
+        struct catalog *cat = open_catalog(rev_dir);
+        if (!cat) {
+                free_tree(current_tree);
+                free(rev);
+                return NULL;
         }
 
-        rev->version = next_version;
+        rev->version = catalog_next_version(cat);
+        int keyframe = config.reverse_deltas || needs_keyframe(cat, base->version);
+        free_catalog(cat);
+
         rev->base_tree = NULL;
         rev->delta = calculate_tree_delta(base->base_tree, current_tree);
         rev->base_version = base->version;
@@ -108,166 +256,331 @@ struct revision *create_delta_revision(const char *rev_dir, struct revision *bas
                 return NULL;
         }
 
-        // Calculate hash based on base hash + delta
-        FILE *tmp = tmpfile();
-        if (!tmp) {
-                free_tree_delta(rev->delta);
-                free_tree(current_tree);
-                free(rev);
-                return NULL;
-        }
-
-        fwrite(base->hash, SHA_DIGEST_LENGTH, 1, tmp);
-        if (serialize_tree_delta(tmp, rev->delta) != 0) {
-                fclose(tmp);
-                free_tree_delta(rev->delta);
-                free_tree(current_tree);
-                free(rev);
-                return NULL;
+        // Store modified files as deltas against their previous version. In
+        // reverse mode the old versions become deltas instead, later on.
+        if (!config.reverse_deltas) {
+                store_file_deltas(rev->delta);
         }
 
-        fseek(tmp, 0, SEEK_END);
-        size_t size = ftell(tmp);
-        fseek(tmp, 0, SEEK_SET);
+        // The revision is identified by the Merkle root of the tree it describes
+        memcpy(rev->hash, current_tree->hash, SHA_DIGEST_LENGTH);
+        rev->entry_count = 0;
+        rev->raw_size = 0;
+        count_tree(current_tree, &rev->entry_count, &rev->raw_size);
 
-        unsigned char *buffer = malloc(size);
-        if (!buffer) {
-                fclose(tmp);
-                free_tree_delta(rev->delta);
-                free_tree(current_tree);
-                free(rev);
-                return NULL;
-        }
-
-        if (fread(buffer, 1, size, tmp) != size) {
-                free(buffer);
-                fclose(tmp);
-                free_tree_delta(rev->delta);
+        // Keyframes store the whole tree; the delta is kept only for reporting
+        if (keyframe) {
+                rev->base_tree = current_tree;
+                rev->base_version = -1;
+        } else {
                 free_tree(current_tree);
-                free(rev);
-                return NULL;
         }
 
-        SHA1(buffer, size, rev->hash);
-
-        free(buffer);
-        fclose(tmp);
-        free_tree(current_tree);
-
         return rev;
 }
 
+// Builds header-only revisions from the catalog, without opening revision files
 struct revision **get_revisions(const char *rev_dir, size_t *count)
 {
         *count = 0;
-        char rev_path[PATH_MAX];
-       
-        while (1) {
-                snprintf(rev_path, PATH_MAX, "%s/revision_%zu", rev_dir, *count);
-                FILE *test = fopen(rev_path, "r");
-                if (test == NULL) {
-                        break;
-                }
-                fclose(test);
-                (*count)++;
+
+        struct catalog *cat = open_catalog(rev_dir);
+        if (!cat) return NULL;
+
+        struct revision **revisions = calloc(cat->count + 1, sizeof(struct revision*));
+        if (!revisions) {
+                free_catalog(cat);
+                return NULL;
         }
 
-        struct revision **revisions = malloc((*count + 1) * sizeof(struct revision*));
-        if (!revisions) return NULL;
+        for (size_t i = 0; i < cat->count; i++) {
+                const struct catalog_record *record = &cat->records[i];
 
-        for (int i = 0; i < *count; i++) {
-                snprintf(rev_path, PATH_MAX, "%s/revision_%d", rev_dir, i);
-                revisions[i] = load_revision_from_file(rev_path);
+                revisions[i] = calloc(1, sizeof(struct revision));
                 if (!revisions[i]) {
-                        for (int j = 0; j < i; j++) {
+                        for (size_t j = 0; j < i; j++) {
                                 free_revision(revisions[j]);
                         }
                         free(revisions);
+                        free_catalog(cat);
                         return NULL;
                 }
+
+                revisions[i]->version = record->version;
+                revisions[i]->base_version = record->parent;
+                revisions[i]->entry_count = record->entry_count;
+                revisions[i]->raw_size = record->raw_size;
+                revisions[i]->stored_size = record->stored_size;
+                revisions[i]->body_offset = record->offset;
+                revisions[i]->timestamp = record->timestamp;
+                revisions[i]->added = record->added;
+                revisions[i]->removed = record->removed;
+                revisions[i]->modified = record->modified;
+                memcpy(revisions[i]->hash, record->hash, SHA_DIGEST_LENGTH);
         }
 
-        revisions[*count] = NULL;
+        *count = cat->count;
+        free_catalog(cat);
         return revisions;
 }
 
+/*
+ * Revision files start with a magic and format version, followed by the
+ * revision number, base (offset by one so -1 fits a varint), the Merkle
+ * root, and then either the full tree or the delta records.
+ */
 int save_revision_to_file(const char *filepath, struct revision *rev)
 {
         if (!filepath || !rev) return -1;
 
-        FILE *f = fopen(filepath, "wb");
+        struct buffer buf;
+        buffer_init(&buf);
+
+        buffer_put(&buf, revision_magic, sizeof(revision_magic));
+        buffer_put_u8(&buf, REVISION_FORMAT_VERSION);
+        buffer_put_varint(&buf, rev->version);
+        buffer_put_varint(&buf, rev->base_version + 1);
+        buffer_put(&buf, rev->hash, SHA_DIGEST_LENGTH);
+        buffer_put_varint(&buf, rev->entry_count);
+        buffer_put_varint(&buf, rev->raw_size);
+        rev->body_offset = buf.len;
+
+        if (rev->base_tree) {
+                encode_tree(&buf, rev->base_tree);
+        } else if (rev->delta) {
+                encode_tree_delta(&buf, rev->delta);
+        }
+
+        // Written aside and renamed, as revisions may be rewritten in place
+        char tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", filepath);
+
+        FILE *f = fopen(tmp_path, "wb");
         if (!f) {
                 perror("fopen");
+                buffer_free(&buf);
                 return -1;
         }
 
-        if (fwrite(&rev->version, sizeof(int), 1, f) != 1 ||
-            fwrite(&rev->base_version, sizeof(int), 1, f) != 1 ||
-            fwrite(rev->hash, SHA_DIGEST_LENGTH, 1, f) != 1) {
-                fclose(f);
+        int ret = buffer_write(&buf, f);
+        if (fclose(f) != 0) ret = -1;
+        if (ret == 0 && rename(tmp_path, filepath) != 0) {
+                perror("rename");
+                ret = -1;
+        }
+        if (ret != 0) unlink(tmp_path);
+
+        rev->stored_size = buf.len;
+        buffer_free(&buf);
+        return ret;
+}
+
+// Writes rev as revision_N in rev_dir and records it in the catalog
+int store_revision(const char *rev_dir, struct revision *rev)
+{
+        char rev_path[PATH_MAX];
+        snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, rev->version);
+
+        struct catalog *cat = open_catalog(rev_dir);
+        if (!cat) return -1;
+
+        // A file the catalog does not know of may be the only copy of a revision
+        if (access(rev_path, F_OK) == 0) {
+                fprintf(stderr, "Refusing to overwrite %s, which is not in the catalog\n", rev_path);
+                free_catalog(cat);
                 return -1;
         }
 
-        if (rev->base_tree) {
-                if (serialize_tree(f, rev->base_tree) != 0) {
-                        fclose(f);
-                        return -1;
-                }
-        } else if (rev->delta) {
-                if (serialize_tree_delta(f, rev->delta) != 0) {
-                        fclose(f);
-                        return -1;
-                }
+        if (save_revision_to_file(rev_path, rev) != 0) {
+                free_catalog(cat);
+                return -1;
         }
 
-        fclose(f);
-        return 0;
+        struct catalog_record record = {
+                .version = rev->version,
+                .parent = rev->base_version,
+                .timestamp = time(NULL),
+                .entry_count = rev->entry_count,
+                .raw_size = rev->raw_size,
+                .stored_size = rev->stored_size,
+                .offset = rev->body_offset,
+        };
+        memcpy(record.hash, rev->hash, SHA_DIGEST_LENGTH);
+        count_changes(rev, &record);
+
+        int ret = catalog_append(cat, &record);
+        free_catalog(cat);
+        return ret;
 }
 
-struct revision *load_revision_from_file(const char *filepath) 
+/*
+ * Reverse-delta mode: once latest has been stored in full, rewrite prev,
+ * the revision it was diffed against, as a delta from latest back to prev.
+ * The newest revision then restores without replaying anything, and older
+ * ones are reached by walking back from it.
+ */
+int store_reverse_delta(const char *rev_dir, struct revision *prev, struct revision *latest)
 {
-        if (!filepath) return NULL;
+        if (!prev || !prev->base_tree || !latest || !latest->base_tree) return -1;
 
-        FILE *f = fopen(filepath, "rb");
-        if (!f) {
-                perror("fopen");
+        struct catalog *cat = open_catalog(rev_dir);
+        if (!cat) return -1;
+
+        const struct catalog_record *old = catalog_find(cat, prev->version);
+        if (!old) {
+                free_catalog(cat);
+                return -1;
+        }
+
+        struct revision rev = {
+                .version = prev->version,
+                .base_version = latest->version,
+                .entry_count = old->entry_count,
+                .raw_size = old->raw_size,
+        };
+        memcpy(rev.hash, prev->hash, SHA_DIGEST_LENGTH);
+
+        rev.delta = calculate_tree_delta(latest->base_tree, prev->base_tree);
+        if (!rev.delta) {
+                free_catalog(cat);
+                return -1;
+        }
+        store_file_deltas(rev.delta);
+
+        char rev_path[PATH_MAX];
+        snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, rev.version);
+
+        int ret = save_revision_to_file(rev_path, &rev);
+        if (ret == 0) {
+                struct catalog_record record = *old;
+                record.parent = rev.base_version;
+                record.stored_size = rev.stored_size;
+                record.offset = rev.body_offset;
+                ret = catalog_append(cat, &record);
+        }
+
+        free_tree_delta(rev.delta);
+        free_catalog(cat);
+        return ret;
+}
+
+/*
+ * Maps a revision file read-only. Trees are decoded straight out of the
+ * mapping and file contents live in the object store, so loading costs the
+ * size of the metadata only.
+ */
+static unsigned char *map_revision_file(const char *filepath, size_t *len)
+{
+        int fd = open(filepath, O_RDONLY);
+        if (fd < 0) {
+                perror("open");
                 return NULL;
         }
 
-        struct revision *rev = malloc(sizeof(struct revision));
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                fprintf(stderr, "Empty revision file: %s\n", filepath);
+                close(fd);
+                return NULL;
+        }
+
+        *len = st.st_size;
+        unsigned char *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED) {
+                perror("mmap");
+                return NULL;
+        }
+
+        madvise(data, *len, MADV_SEQUENTIAL);
+        return data;
+}
+
+// Reads the fixed part of a revision file, leaving rd at the tree or delta
+static struct revision *decode_revision_header(struct reader *rd, const char *filepath)
+{
+        struct revision *rev = calloc(1, sizeof(struct revision));
         if (!rev) {
-                fclose(f);
+                perror("calloc");
                 return NULL;
         }
 
-        if (fread(&rev->version, sizeof(int), 1, f) != 1 ||
-            fread(&rev->base_version, sizeof(int), 1, f) != 1 ||
-            fread(rev->hash, SHA_DIGEST_LENGTH, 1, f) != 1) {
+        char magic[sizeof(revision_magic)];
+        reader_get(rd, magic, sizeof(magic));
+        uint8_t format = reader_get_u8(rd);
+        rev->version = reader_get_varint(rd);
+        rev->base_version = (int)reader_get_varint(rd) - 1;
+        reader_get(rd, rev->hash, SHA_DIGEST_LENGTH);
+        rev->entry_count = reader_get_varint(rd);
+        rev->raw_size = reader_get_varint(rd);
+
+        /*
+         * Files without the magic come from releases that stored file contents
+         * inside the revision. They are not converted: restore them with the
+         * release that wrote them and snapshot the result again.
+         */
+        if (memcmp(magic, revision_magic, sizeof(magic)) != 0) {
+                fprintf(stderr, "%s was written by an svd release older than the object store "
+                        "and cannot be read by this one\n", filepath);
                 free(rev);
-                fclose(f);
                 return NULL;
         }
 
-        if (rev->base_version == -1) {
-                rev->delta = NULL;
-                if (deserialize_tree(f, &rev->base_tree) != 0) {
-                        free(rev);
-                        fclose(f);
-                        return NULL;
-                }
-        } else {
-                rev->base_tree = NULL;
-                if (deserialize_tree_delta(f, &rev->delta) != 0) {
-                        free(rev);
-                        fclose(f);
-                        return NULL;
+        if (rd->failed || format < REVISION_MIN_FORMAT_VERSION || format > REVISION_FORMAT_VERSION) {
+                fprintf(stderr, "Unsupported revision file: %s\n", filepath);
+                free(rev);
+                return NULL;
+        }
+        return rev;
+}
+
+static struct revision *load_revision(const char *filepath, int with_body)
+{
+        if (!filepath) return NULL;
+
+        size_t len;
+        unsigned char *data = map_revision_file(filepath, &len);
+        if (!data) return NULL;
+
+        struct reader rd;
+        reader_init(&rd, data, len);
+
+        struct revision *rev = decode_revision_header(&rd, filepath);
+        int ret = rev ? 0 : -1;
+
+        if (rev) {
+                rev->stored_size = len;
+                rev->body_offset = rd.pos - data;
+        }
+
+        if (rev && with_body) {
+                if (rev->base_version == -1) {
+                        ret = decode_tree(&rd, NULL, &rev->base_tree);
+                } else {
+                        ret = decode_tree_delta(&rd, &rev->delta);
                 }
         }
 
-        fclose(f);
+        munmap(data, len);
+        if (ret != 0) {
+                free(rev);
+                return NULL;
+        }
         return rev;
 }
 
+struct revision *load_revision_from_file(const char *filepath) 
+{
+        return load_revision(filepath, 1);
+}
+
+// Loads only the version, base and hash; base_tree and delta stay NULL
+struct revision *load_revision_header(const char *filepath)
+{
+        return load_revision(filepath, 0);
+}
+
 void free_revision(struct revision *rev) 
 {
         if (!rev) return;
@@ -281,74 +594,111 @@ void free_revision(struct revision *rev)
         free(rev);
 }
 
-int restore_specific_revision(const char *rev_dir, int target_version, const char *output_dir) 
+/*
+ * Lists the versions needed to rebuild version, from the keyframe it hangs
+ * off up to version itself. Returns the count, or -1 if the chain is broken.
+ */
+static int revision_chain(const struct catalog *cat, int version, int **chain)
 {
-        char rev_path[PATH_MAX];
-        snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, target_version);
-        
-        struct revision *rev = load_revision_from_file(rev_path);
-        if (!rev) {
-                fprintf(stderr, "Failed to load revision %d\n", target_version);
-                return 1;
+        int len = 0;
+        const struct catalog_record *record = catalog_find(cat, version);
+
+        *chain = malloc((cat->count ? cat->count : 1) * sizeof(int));
+        if (!*chain) {
+                perror("malloc");
+                return -1;
         }
 
-        if (rev->base_tree) {
-                if (restore_directory(rev->base_tree, output_dir) != 0) {
-                        fprintf(stderr, "Failed to restore directory\n");
-                        free_revision(rev);
-                        return 1;
-                }
-        } else {
-                char base_path[PATH_MAX];
-                snprintf(base_path, sizeof(base_path), "%s/revision_0", rev_dir);
-                struct revision *base = load_revision_from_file(base_path);
-                if (!base) {
-                        fprintf(stderr, "Failed to load base revision\n");
-                        free_revision(rev);
-                        return 1;
-                }
+        while (record && (size_t)len < cat->count) {
+                (*chain)[len++] = record->version;
+                if (record->parent == -1) break;
+                record = catalog_find(cat, record->parent);
+        }
 
-                struct tree *working_tree = NULL;
-                FILE *tmp = tmpfile();
-                if (!tmp) {
-                        free_revision(base);
-                        free_revision(rev);
-                        return 1;
-                }
+        if (!record || record->parent != -1) {
+                fprintf(stderr, "Broken revision chain for %d\n", version);
+                free(*chain);
+                return -1;
+        }
 
-                serialize_tree(tmp, base->base_tree);
-                fseek(tmp, 0, SEEK_SET);
-                deserialize_tree(tmp, &working_tree);
-                fclose(tmp);
-
-                // apply all deltas up to the target version
-                for (int i = 1; i <= target_version; i++) {
-                        char delta_path[PATH_MAX];
-                        snprintf(delta_path, sizeof(delta_path), "%s/revision_%d", rev_dir, i);
-                        struct revision *delta_rev = load_revision_from_file(delta_path);
-                        if (!delta_rev) {
-                                fprintf(stderr, "Failed to load revision %d\n", i);
-                                free_tree(working_tree);
-                                free_revision(base);
-                                free_revision(rev);
-                                return 1;
-                        }
+        for (int i = 0; i < len / 2; i++) {
+                int tmp = (*chain)[i];
+                (*chain)[i] = (*chain)[len - 1 - i];
+                (*chain)[len - 1 - i] = tmp;
+        }
+        return len;
+}
 
-                        apply_tree_delta(working_tree, delta_rev->delta);
-                        free_revision(delta_rev);
-                }
+// Returns -1 if rev_dir has no revisions yet and -2 if they cannot be read
+int latest_revision(const char *rev_dir)
+{
+        struct catalog *cat = open_catalog(rev_dir);
+        if (!cat) return -2;
+
+        int version = cat->count ? cat->records[cat->count - 1].version : -1;
+        free_catalog(cat);
+        return version;
+}
+
+/*
+ * Rebuilds the full tree of a revision by loading the nearest keyframe
+ * before it and applying only the deltas between the two.
+ */
+struct revision *materialize_revision(const char *rev_dir, int version)
+{
+        struct catalog *cat = open_catalog(rev_dir);
+        if (!cat) return NULL;
 
-                // restore the final state
-                if (restore_directory(working_tree, output_dir) != 0) {
-                        fprintf(stderr, "Failed to restore directory\n");
-                        free_tree(working_tree);
-                        free_revision(base);
+        if (!catalog_find(cat, version)) {
+                fprintf(stderr, "No revision %d\n", version);
+                free_catalog(cat);
+                return NULL;
+        }
+
+        int *chain;
+        int len = revision_chain(cat, version, &chain);
+        free_catalog(cat);
+        if (len < 0) return NULL;
+
+        char rev_path[PATH_MAX];
+        snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, chain[0]);
+
+        struct revision *rev = load_revision_from_file(rev_path);
+        for (int i = 1; rev && i < len; i++) {
+                snprintf(rev_path, sizeof(rev_path), "%s/revision_%d", rev_dir, chain[i]);
+                struct revision *delta_rev = load_revision_from_file(rev_path);
+                if (!delta_rev || !delta_rev->delta) {
+                        fprintf(stderr, "Failed to load revision %d\n", chain[i]);
+                        free_revision(delta_rev);
                         free_revision(rev);
-                        return 1;
+                        rev = NULL;
+                        break;
                 }
 
-                free_tree(working_tree);
-                free_revision(base);
+                apply_tree_delta(rev->base_tree, delta_rev->delta);
+                rev->version = delta_rev->version;
+                memcpy(rev->hash, delta_rev->hash, SHA_DIGEST_LENGTH);
+                memcpy(rev->base_tree->hash, delta_rev->hash, SHA_DIGEST_LENGTH);
+                free_revision(delta_rev);
+        }
+
+        free(chain);
+        return rev;
+}
+
+int restore_specific_revision(const char *rev_dir, int target_version, const char *output_dir,
+                              const char *rel_path)
+{
+        struct revision *rev = materialize_revision(rev_dir, target_version);
+        if (!rev) {
+                fprintf(stderr, "Failed to load revision %d\n", target_version);
+                return 1;
+        }
+
+        if (restore_directory(rev->base_tree, output_dir, rel_path) != 0) {
+                fprintf(stderr, "Failed to restore directory\n");
+                free_revision(rev);
+                return 1;
         }
 
         free_revision(rev);
@@ -1,6 +1,7 @@
 #ifndef REVISION_H
 #define REVISION_H
 
+#include <stdint.h>
 #include <openssl/sha.h>
 #include "tree.h"
 #include "delta.h"
@@ -11,14 +12,29 @@ struct revision {
         struct tree *base_tree;
         struct tree_delta *delta;
         int base_version;              
+        uint64_t entry_count;
+        uint64_t raw_size;
+        size_t stored_size;
+        size_t body_offset;
+        // Filled in from the catalog by get_revisions() only
+        int64_t timestamp;
+        uint64_t added;
+        uint64_t removed;
+        uint64_t modified;
 };
 
-struct revision *create_base_revision(const char *dir_path);
+struct revision *create_base_revision(const char *rev_dir, const char *dir_path);
 struct revision *create_delta_revision(const char *rev_dir, struct revision *base, const char *current_dir);
 struct revision **get_revisions(const char *rev_dir, size_t *count);
 int save_revision_to_file(const char *filepath, struct revision *rev);
+int store_revision(const char *rev_dir, struct revision *rev);
+int store_reverse_delta(const char *rev_dir, struct revision *prev, struct revision *latest);
 struct revision *load_revision_from_file(const char *filepath);
+struct revision *load_revision_header(const char *filepath);
 void free_revision(struct revision *rev);
-int restore_specific_revision(const char *rev_dir, int target_version, const char *output_dir);
+int latest_revision(const char *rev_dir);
+struct revision *materialize_revision(const char *rev_dir, int version);
+int restore_specific_revision(const char *rev_dir, int target_version, const char *output_dir,
+                              const char *rel_path);
 
 #endif
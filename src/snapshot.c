@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <time.h>
 
 #include "config.h"
 #include "snapshot.h"
@@ -12,9 +13,14 @@
 #include "utils.h"
 #include "revision.h"
 #include "tree.h"
+#include "status.h"
+#include "delta.h"
+#include "catalog.h"
+#include "gc.h"
+#include "object.h"
 
-int create_snapshot(const char *dir_path)
-{       
+static int store_snapshot(const char *dir_path)
+{
         if (!path_exists(dir_path)) {
                 fprintf(stderr, "Error: Targetted directory does not exist.\n");
                 return 1;
@@ -29,18 +35,21 @@ int create_snapshot(const char *dir_path)
                 return 1;
         }
 
-        char base_path[PATH_MAX];
-        snprintf(base_path, PATH_MAX, "%s/revision_0", rev_dir);
+        int latest = latest_revision(rev_dir);
+        if (latest < -1) {
+                fprintf(stderr, "Cannot read the revisions of %s; not storing\n", dir_path);
+                return 1;
+        }
 
-        if (access(base_path, F_OK) == -1) {
-                struct revision *base = create_base_revision(dir_path);
+        if (latest < 0) {
+                struct revision *base = create_base_revision(rev_dir, dir_path);
                 if (!base) {
                         perror("create base");
                         return 1;
                 }
                 
 
-                if (save_revision_to_file(base_path, base) != 0) {
+                if (store_revision(rev_dir, base) != 0) {
                         perror("save revision");
                         free_revision(base);
                         return 1;
@@ -49,10 +58,10 @@ int create_snapshot(const char *dir_path)
                 printf("Saved base revision: %s\n", dir_path);
                 free_revision(base);
         } else {
-                struct revision *base = load_revision_from_file(base_path);
+                // New revisions are diffed against the latest one
+                struct revision *base = materialize_revision(rev_dir, latest);
                 if (!base) {
-                        perror("load revision");
-                        fprintf(stderr, "failed to load revision from file: %s\n", base_path);
+                        fprintf(stderr, "failed to load revision %d: %s\n", latest, dir_path);
                         return 1;
                 }
 
@@ -63,17 +72,20 @@ int create_snapshot(const char *dir_path)
                         return 1;
                 }
 
-                char delta_path[PATH_MAX];
-                snprintf(delta_path, sizeof(delta_path), "%s/revision_%d", rev_dir, delta->version);
-
-                if (save_revision_to_file(delta_path, delta) != 0) {
-                        fprintf(stderr, "failed to save delta revision: %s\n", delta_path);
+                if (store_revision(rev_dir, delta) != 0) {
+                        fprintf(stderr, "failed to save delta revision %d: %s\n", delta->version, dir_path);
                         free_revision(delta);
                         free_revision(base);
                         return 1;
                 }
 
-                printf("Saved delta revision: %s\n", dir_path);
+                if (config.reverse_deltas && store_reverse_delta(rev_dir, base, delta) != 0) {
+                        fprintf(stderr, "failed to rewrite revision %d as a reverse delta\n", base->version);
+                }
+
+                printf("Saved %s revision %d: %s (%zu unchanged subtrees skipped)\n",
+                       delta->base_tree ? "keyframe" : "delta", delta->version,
+                       dir_path, delta->delta->pruned_subtrees);
                 free_revision(delta);
                 free_revision(base);
 
@@ -82,12 +94,102 @@ int create_snapshot(const char *dir_path)
         return 0;
 }
 
-int restore_snapshot(const char *dir_path, const int version)
+// Held shared while objects are written and referenced, so a collection waits
+int create_snapshot(const char *dir_path)
+{
+        int lock = lock_object_store(0);
+        if (lock < 0) return 1;
+
+        int ret = store_snapshot(dir_path);
+        unlock_object_store(lock);
+        return ret;
+}
+
+int restore_snapshot(const char *dir_path, const int version, const char *rel_path)
 {
         long int inode = get_dir_inode(dir_path);
         char rev_dir[PATH_MAX];
         snprintf(rev_dir, sizeof(rev_dir), "%s/%ld", config.revisions, inode);
-        return (int)restore_specific_revision(rev_dir, version, dir_path);
+        return (int)restore_specific_revision(rev_dir, version, dir_path, rel_path);
+}
+
+/*
+ * Reports how dir_path differs from a revision, the latest when version is
+ * negative. Returns STATUS_CLEAN, STATUS_CHANGED or STATUS_ERROR, suitable
+ * as an exit code.
+ */
+int compare_snapshot(const char *dir_path, int version)
+{
+        long int inode = get_dir_inode(dir_path);
+        char rev_dir[PATH_MAX];
+        snprintf(rev_dir, sizeof(rev_dir), "%s/%ld", config.revisions, inode);
+
+        if (version < 0) version = latest_revision(rev_dir);
+        if (version < 0) {
+                fprintf(stderr, "No revisions of %s\n", dir_path);
+                return STATUS_ERROR;
+        }
+
+        struct revision *rev = materialize_revision(rev_dir, version);
+        if (!rev) {
+                fprintf(stderr, "Failed to load revision %d\n", version);
+                return STATUS_ERROR;
+        }
+
+        struct status_counts counts;
+        int ret = compare_directory(rev->base_tree, dir_path, &counts);
+        free_revision(rev);
+
+        if (ret != 0) return STATUS_ERROR;
+
+        size_t changes = counts.added + counts.removed + counts.modified + counts.metadata;
+        if (config.stats) {
+                printf("Compared with revision %d: %zu added, %zu removed, %zu modified, "
+                       "%zu metadata changed, %zu files hashed\n", version, counts.added,
+                       counts.removed, counts.modified, counts.metadata, counts.hashed);
+        }
+        return changes ? STATUS_CHANGED : STATUS_CLEAN;
+}
+
+/*
+ * Lists what changed from revision from to revision to, the latest when to
+ * is negative. Both trees are rebuilt from metadata only, and subtrees with
+ * equal hashes are skipped without being visited. Returns the same codes
+ * as compare_snapshot().
+ */
+int diff_snapshot(const char *dir_path, int from, int to)
+{
+        long int inode = get_dir_inode(dir_path);
+        char rev_dir[PATH_MAX];
+        snprintf(rev_dir, sizeof(rev_dir), "%s/%ld", config.revisions, inode);
+
+        if (from < 0) from = 0;
+        if (to < 0) to = latest_revision(rev_dir);
+
+        struct revision *old_rev = materialize_revision(rev_dir, from);
+        struct revision *new_rev = old_rev ? materialize_revision(rev_dir, to) : NULL;
+        if (!new_rev) {
+                fprintf(stderr, "Failed to load revisions %d and %d\n", from, to);
+                free_revision(old_rev);
+                return STATUS_ERROR;
+        }
+
+        struct tree_delta *delta = calculate_tree_delta(old_rev->base_tree, new_rev->base_tree);
+        int ret = STATUS_ERROR;
+
+        if (delta) {
+                size_t changes = print_tree_delta(stdout, delta, config.stats);
+                if (config.stats) {
+                        printf("Revision %d to %d: %zu changes, %zu unchanged subtrees skipped\n",
+                               from, to, changes, delta->pruned_subtrees);
+                }
+                ret = changes ? STATUS_CHANGED : STATUS_CLEAN;
+        }
+
+        free_tree_delta(delta);
+        free_revision(new_rev);
+        free_revision(old_rev);
+        return ret;
 }
 
 int discard_snapshot(const char *dir_path) 
@@ -95,12 +197,51 @@ int discard_snapshot(const char *dir_path)
         long int inode = get_dir_inode(dir_path);
         char rev_dir[PATH_MAX];
         snprintf(rev_dir, sizeof(rev_dir), "%s/%ld", config.revisions, inode);
-        return (int)remove_dir(rev_dir);
+
+        if (remove_dir(rev_dir) != 0) {
+                perror("remove");
+                return 1;
+        }
+
+        // File contents live in the shared object store; drop what no one uses now
+        return collect_garbage() != 0;
+}
+
+static void print_change_count(const char *sign, uint64_t count)
+{
+        if (count == CATALOG_UNKNOWN) {
+                printf(" %s?", sign);
+        } else {
+                printf(" %s%llu", sign, (unsigned long long)count);
+        }
 }
 
-static void print_revision_details(struct revision *revision)
+// Everything printed comes from the catalog; no revision file is opened
+static void print_revision_details(const struct revision *revision)
 {
-       print_tree_structure(revision->base_tree); 
+        printf("Revision %d: ", revision->version);
+        print_sha1(revision->hash);
+        printf("\n");
+
+        char date[32];
+        time_t when = revision->timestamp;
+        struct tm *tm = localtime(&when);
+        if (!tm || strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", tm) == 0) {
+                snprintf(date, sizeof(date), "unknown");
+        }
+
+        printf("    %s, %llu entries, %llu bytes, %zu stored,", date,
+               (unsigned long long)revision->entry_count,
+               (unsigned long long)revision->raw_size, revision->stored_size);
+        print_change_count("+", revision->added);
+        print_change_count("-", revision->removed);
+        print_change_count("~", revision->modified);
+
+        if (revision->base_version == -1) {
+                printf(", keyframe\n");
+        } else {
+                printf(", delta on %d\n", revision->base_version);
+        }
 }
 
 int list_snapshot(const char *dir_path) 
@@ -112,10 +253,14 @@ int list_snapshot(const char *dir_path)
         size_t count;
         struct revision **revisions = get_revisions(rev_dir, &count);
         
+        if (!revisions) return 1;
+
         printf("count: %zu\n", count);
         for (size_t i = 0; i < count; i++) {
                 print_revision_details(revisions[i]);
+                free_revision(revisions[i]);
         }
+        free(revisions);
 
         return 0;
 }
@@ -2,8 +2,10 @@
 #define SNAPSHOT_H
 
 int create_snapshot(const char *dir_path);
-int restore_snapshot(const char *dir_path, const int version);
+int restore_snapshot(const char *dir_path, const int version, const char *rel_path);
 int discard_snapshot(const char *dir_path);
 int list_snapshot(const char *dir_path);
+int compare_snapshot(const char *dir_path, int version);
+int diff_snapshot(const char *dir_path, int from, int to);
 
 #endif
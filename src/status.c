@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "tree.h"
+#include "status.h"
+
+#define HASH_BUFFER_SIZE (64 * 1024)
+
+// Paths are printed relative to the compared directory; directories end in '/'
+static void report(const char *what, const char *rel_path, int is_dir)
+{
+        printf("%s: %s%s\n", what, rel_path, is_dir ? "/" : "");
+}
+
+static int hash_file(const char *path, unsigned char *hash)
+{
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+                perror("fopen");
+                return -1;
+        }
+
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        unsigned char *buf = malloc(HASH_BUFFER_SIZE);
+        int ret = -1;
+
+        if (ctx && buf && EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) == 1) {
+                size_t n;
+                while ((n = fread(buf, 1, HASH_BUFFER_SIZE, file)) > 0) {
+                        EVP_DigestUpdate(ctx, buf, n);
+                }
+                if (!ferror(file) && EVP_DigestFinal_ex(ctx, hash, NULL) == 1) {
+                        ret = 0;
+                }
+        }
+
+        free(buf);
+        EVP_MD_CTX_free(ctx);
+        fclose(file);
+        return ret;
+}
+
+/*
+ * Same size and mtime means unchanged contents, as for the snapshot stat
+ * cache. A file touched without changing size is hashed to tell. Metadata
+ * means mode and owner: like snapshots, status ignores an mtime change
+ * that left the contents alone.
+ */
+static int compare_file(const struct tree_entry *entry, const char *path, const char *rel_path,
+                        const struct stat *st, struct status_counts *counts)
+{
+        const struct blob *blob = entry->blob;
+        if (!blob) return 0;
+
+        if (!S_ISREG(st->st_mode) || (size_t)st->st_size != blob->size) {
+                report("modified", rel_path, 0);
+                counts->modified++;
+                return 0;
+        }
+
+        int same_mtime = st->st_mtim.tv_sec == blob->mtime.tv_sec &&
+                         st->st_mtim.tv_nsec == blob->mtime.tv_nsec;
+
+        if (!same_mtime) {
+                unsigned char hash[SHA_DIGEST_LENGTH];
+                counts->hashed++;
+                if (hash_file(path, hash) != 0) return -1;
+
+                if (memcmp(hash, entry->hash, SHA_DIGEST_LENGTH) != 0) {
+                        report("modified", rel_path, 0);
+                        counts->modified++;
+                        return 0;
+                }
+        }
+
+        if ((st->st_mode & 07777) != (blob->mode & 07777) ||
+            st->st_uid != blob->uid || st->st_gid != blob->gid) {
+                report("metadata", rel_path, 0);
+                counts->metadata++;
+        }
+        return 0;
+}
+
+static int compare_tree(struct tree *tree, const char *dir_path, const char *rel_path,
+                        struct status_counts *counts)
+{
+        char full_path[1024];
+        char entry_rel_path[1024];
+
+        for (struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->name);
+                snprintf(entry_rel_path, sizeof(entry_rel_path), "%s%s%s",
+                         rel_path, rel_path[0] ? "/" : "", entry->name);
+
+                struct stat st;
+                if (lstat(full_path, &st) < 0) {
+                        if (errno != ENOENT) {
+                                perror("lstat");
+                                return -1;
+                        }
+                        report("removed", entry_rel_path, entry->type == ENTRY_TREE);
+                        counts->removed++;
+                        continue;
+                }
+
+                if (entry->type == ENTRY_TREE) {
+                        if (!S_ISDIR(st.st_mode)) {
+                                report("modified", entry_rel_path, 0);
+                                counts->modified++;
+                        } else if (entry->subtree &&
+                                   compare_tree(entry->subtree, full_path, entry_rel_path, counts) != 0) {
+                                return -1;
+                        }
+                } else if (compare_file(entry, full_path, entry_rel_path, &st, counts) != 0) {
+                        return -1;
+                }
+        }
+
+        DIR *dir = opendir(dir_path);
+        if (!dir) {
+                perror("opendir");
+                return -1;
+        }
+
+        struct dirent *d;
+        while ((d = readdir(dir)) != NULL) {
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 ||
+                    find_tree_entry(tree, d->d_name)) {
+                        continue;
+                }
+
+                // Only what a snapshot would record counts as added
+                struct stat st;
+                snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, d->d_name);
+                if (lstat(full_path, &st) != 0 || !is_snapshot_type(st.st_mode)) continue;
+
+                snprintf(entry_rel_path, sizeof(entry_rel_path), "%s%s%s",
+                         rel_path, rel_path[0] ? "/" : "", d->d_name);
+                report("added", entry_rel_path, S_ISDIR(st.st_mode));
+                counts->added++;
+        }
+
+        closedir(dir);
+        return 0;
+}
+
+// Prints one line per difference; returns -1 if the directory could not be read
+int compare_directory(struct tree *tree, const char *dir_path, struct status_counts *counts)
+{
+        if (!tree || !dir_path || !counts) return -1;
+
+        memset(counts, 0, sizeof(*counts));
+        return compare_tree(tree, dir_path, "", counts);
+}
@@ -0,0 +1,29 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stddef.h>
+#include "tree.h"
+
+/*
+ * Working-directory status against a stored tree. Files are judged by the
+ * stat data recorded in their blobs; only a file whose size matches but
+ * whose mtime does not is read and hashed. Object contents are never
+ * loaded.
+ */
+
+// Exit codes of the compare command
+#define STATUS_CLEAN 0
+#define STATUS_CHANGED 1
+#define STATUS_ERROR 2
+
+struct status_counts {
+        size_t added;
+        size_t removed;
+        size_t modified;
+        size_t metadata;
+        size_t hashed;
+};
+
+int compare_directory(struct tree *tree, const char *dir_path, struct status_counts *counts);
+
+#endif
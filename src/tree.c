@@ -8,13 +8,44 @@
 #include <dirent.h>
 #include <utime.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <zlib.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "main.h"
 #include "tree.h"
 #include "delta.h"
+#include "object.h"
+#include "index.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "buffer.h"
+#include "arena.h"
+#include "fs.h"
+
+static void fill_blob_stat(struct blob *blob, const struct stat *st)
+{
+        blob->mode = st->st_mode;
+        blob->uid = st->st_uid;
+        blob->gid = st->st_gid;
+        blob->atime = st->st_atim;
+        blob->mtime = st->st_mtim;
+        blob->ctime = st->st_ctim;
+        blob->link_target = NULL;
+}
+
+static struct blob *alloc_blob(struct arena *arena)
+{
+        struct blob *blob = arena_alloc(arena, sizeof(struct blob));
+        if (!blob) return NULL;
+
+        blob->refs = 1;
+        blob->arena = arena;
+        return blob;
+}
 
-struct blob *create_blob(const char* file_path)
+struct blob *create_blob(struct arena *arena, const char* file_path)
 {
         struct stat st;
         if (lstat(file_path, &st) < 0) {
@@ -22,98 +53,55 @@ struct blob *create_blob(const char* file_path)
                 return NULL;
         }
 
-        struct blob *blob = malloc(sizeof(struct blob));
-        if (!blob) {
-                perror("malloc");
-                return NULL;
-        }
+        struct blob *blob = alloc_blob(arena);
+        if (!blob) return NULL;
 
-        FILE *file = fopen(file_path, "rb");
-        if (!file) {
-                perror("fopen");
-                free(blob);
+        if (write_object_from_file(file_path, blob->hash, &blob->size, &blob->compressed_size) != 0) {
                 return NULL;
         }
 
-        unsigned char *raw_data = malloc(st.st_size);
-        if (!raw_data) {
-                perror("malloc");
-                fclose(file);
-                free(blob);
-                return NULL;
-        }
-
-        if (fread(raw_data, 1, st.st_size, file) != st.st_size) {
-                perror("fread");
-                free(raw_data);
-                fclose(file);
-                free(blob);
-                return NULL;
-        }
-        fclose(file);
-
-        blob->size = st.st_size;
-
-        if (config.compress_files) {
-                uLong compressed_size = compressBound(st.st_size);
-                unsigned char *compressed_data = malloc(compressed_size);
-                if (!compressed_data) {
-                        perror("malloc");
-                        free(raw_data);
-                        free(blob);
-                        return NULL;
-                }
-
-                if (compress(compressed_data, &compressed_size, raw_data, st.st_size) != Z_OK) {
-                        free(compressed_data);
-                        free(raw_data);
-                        free(blob);
-                        return NULL;
-                }
-
-                blob->data = compressed_data;
-                blob->compressed_size = compressed_size;
-                free(raw_data);
-        } else {
-                blob->data = raw_data;
-                blob->compressed_size = st.st_size;
-        }
+        fill_blob_stat(blob, &st);
+        return blob;
+}
 
-        strcpy(blob->type, "blob");
-        blob->mode = st.st_mode;
-        blob->uid = st.st_uid;
-        blob->gid = st.st_gid;
-        blob->atime = st.st_atim;
-        blob->mtime = st.st_mtim;
-        blob->ctime = st.st_ctim;
-        blob->link_target = NULL;
+/*
+ * Builds a blob from stat data and a hash taken from the stat cache, without
+ * touching the file contents. The object must already be in the store.
+ */
+struct blob *create_cached_blob(struct arena *arena, const struct stat *st,
+                                const unsigned char *hash, size_t compressed_size)
+{
+        struct blob *blob = alloc_blob(arena);
+        if (!blob) return NULL;
 
+        blob->size = st->st_size;
+        blob->compressed_size = compressed_size;
+        memcpy(blob->hash, hash, SHA_DIGEST_LENGTH);
+        fill_blob_stat(blob, st);
         return blob;
 }
 
-struct tree_entry *create_tree_entry(const char *name, struct blob *blob) 
+struct tree_entry *create_tree_entry(struct arena *arena, const char *name, struct blob *blob) 
 {
-        struct tree_entry *entry = malloc(sizeof(struct tree_entry));
-        if (!entry) {
-                perror("malloc");
-                return NULL;
-        }
+        struct tree_entry *entry = arena_alloc(arena, sizeof(struct tree_entry));
+        if (!entry) return NULL;
 
-        strncpy(entry->name, name, sizeof(entry->name) - 1);
-        entry->name[sizeof(entry->name) - 1] = '\0';
+        size_t len = strnlen(name, NAME_MAX);
+        entry->name = arena_name(arena, name, len);
+        if (!entry->name) return NULL;
+        entry->name_len = len;
 
         if (blob) {
-                strcpy(entry->type, "blob");
+                entry->type = ENTRY_BLOB;
                 entry->blob = blob;
-                SHA1(blob->data, blob->size, entry->hash);
+                memcpy(entry->hash, blob->hash, sizeof(entry->hash));
         } else {
-                strcpy(entry->type, "tree");
+                entry->type = ENTRY_TREE;
                 entry->blob = NULL;
                 memset(entry->hash, 0, sizeof(entry->hash));
         }
 
-        snprintf(entry->mode, sizeof(entry->mode), "%06o", 
-                blob ? blob->mode : S_IFDIR | 0755);
+        entry->mode = blob ? blob->mode : S_IFDIR | 0755;
         entry->next = NULL;
         entry->subtree = NULL;
         entry->delta = NULL;
@@ -121,39 +109,189 @@ struct tree_entry *create_tree_entry(const char *name, struct blob *blob)
         return entry;
 }
 
-struct tree *create_tree(struct tree_entry *entry) 
+/*
+ * Without an arena, creates the root of a new tree that owns a fresh arena;
+ * freeing that root releases the arena and every node in it.
+ */
+struct tree *create_tree(struct arena *arena, struct tree_entry *entry) 
 {
-        struct tree *tree = malloc(sizeof(struct tree));
+        int owns_arena = !arena;
+        if (owns_arena) {
+                arena = arena_create();
+                if (!arena) return NULL;
+        }
+
+        struct tree *tree = arena_alloc(arena, sizeof(struct tree));
         if (!tree) {
-                perror("malloc");
+                if (owns_arena) arena_unref(arena);
                 return NULL;
         }
 
-        strcpy(tree->type, "tree");
+        tree->refs = 1;
+        tree->arena = arena;
+        tree->owns_arena = owns_arena;
         tree->entry_count = entry ? 1 : 0;
         tree->entries = entry;
 
         return tree;
 }
 
-struct tree *form_tree(const char *dir_path) 
+// Below this many names a comparison sort beats another radix pass
+#define RADIX_SORT_THRESHOLD 1024
+
+static int compare_entry_names(const void *a, const void *b)
 {
-        DIR *dir = opendir(dir_path);
-        if (!dir) {
-                perror("opendir");
-                return NULL;
+        const struct tree_entry *x = *(struct tree_entry *const *)a;
+        const struct tree_entry *y = *(struct tree_entry *const *)b;
+        return strcmp(x->name, y->name);
+}
+
+static int name_byte(const struct tree_entry *entry, size_t depth)
+{
+        return depth < entry->name_len ? (unsigned char)entry->name[depth] + 1 : 0;
+}
+
+/*
+ * MSD radix sort on the byte at depth; every name in entries shares its
+ * first depth bytes. Names that end at depth sort first and are equal, so
+ * only the other buckets are sorted further.
+ */
+static void radix_sort_entries(struct tree_entry **entries, struct tree_entry **scratch,
+                               size_t count, size_t depth)
+{
+        if (count < RADIX_SORT_THRESHOLD) {
+                qsort(entries, count, sizeof(*entries), compare_entry_names);
+                return;
+        }
+
+        size_t starts[259] = { 0 };
+        for (size_t i = 0; i < count; i++) {
+                starts[name_byte(entries[i], depth) + 2]++;
         }
+        for (int b = 2; b < 259; b++) {
+                starts[b] += starts[b - 1];
+        }
+
+        for (size_t i = 0; i < count; i++) {
+                scratch[starts[name_byte(entries[i], depth) + 1]++] = entries[i];
+        }
+        memcpy(entries, scratch, count * sizeof(*entries));
+
+        // starts[b] is now where bucket b begins
+        for (int b = 1; b < 257; b++) {
+                size_t n = starts[b + 1] - starts[b];
+                if (n > 1) {
+                        radix_sort_entries(entries + starts[b], scratch + starts[b], n, depth + 1);
+                }
+        }
+}
 
-        struct tree *root_tree = malloc(sizeof(struct tree));
-        if (!root_tree) {
+/*
+ * Puts entries in strcmp() order of their names, the order the tree diff
+ * merges in and the one tree hashes are computed over. Already sorted
+ * trees, such as every tree written since entries were sorted, are left
+ * alone after a single pass.
+ */
+int sort_tree_entries(struct tree *tree)
+{
+        size_t count = 0;
+        int sorted = 1;
+
+        for (struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                if (entry->next && strcmp(entry->name, entry->next->name) > 0) {
+                        sorted = 0;
+                }
+                count++;
+        }
+        if (sorted) return 0;
+
+        struct tree_entry **entries = malloc(2 * count * sizeof(struct tree_entry *));
+        if (!entries) {
                 perror("malloc");
-                closedir(dir);
-                return NULL;
+                return -1;
+        }
+
+        size_t i = 0;
+        for (struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                entries[i++] = entry;
+        }
+
+        radix_sort_entries(entries, entries + count, count, 0);
+
+        struct tree_entry **link = &tree->entries;
+        for (i = 0; i < count; i++) {
+                *link = entries[i];
+                link = &entries[i]->next;
+        }
+        *link = NULL;
+
+        // Every link moved; the index is rebuilt on its next use
+        tree->index = NULL;
+        free(entries);
+        return 0;
+}
+
+struct scan_ctx {
+        struct arena *arena;
+        struct index *idx;
+        struct pool *pool;
+        struct pipeline *pipeline;
+};
+
+struct scan_job {
+        struct scan_ctx *ctx;
+        struct tree_entry *entry;
+        char *dir_path;
+        char *rel_path;
+};
+
+static void scan_job_run(void *arg);
+
+static int submit_scan_job(struct scan_ctx *ctx, struct tree_entry *entry,
+                           const char *dir_path, const char *rel_path)
+{
+        struct scan_job *job = malloc(sizeof(struct scan_job));
+        if (!job) {
+                perror("malloc");
+                return -1;
         }
 
-        strcpy(root_tree->type, "tree");
-        root_tree->entry_count = 0;
-        root_tree->entries = NULL;
+        job->ctx = ctx;
+        job->entry = entry;
+        job->dir_path = strdup(dir_path);
+        job->rel_path = strdup(rel_path);
+        if (!job->dir_path || !job->rel_path || pool_submit(ctx->pool, scan_job_run, job) != 0) {
+                free(job->dir_path);
+                free(job->rel_path);
+                free(job);
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Reads one directory level into tree. Subdirectories get an empty subtree
+ * that is filled either recursively or, with a pool, by a separate task.
+ * Regular files that miss the stat cache are handed to the ingestion
+ * pipeline when there is one. A subdirectory or file that cannot be read
+ * leaves its entry with a NULL subtree or blob, which finish_tree() drops
+ * once the whole scan is done.
+ */
+// Directories and regular files are recorded; scan_dir skips anything else
+int is_snapshot_type(mode_t mode)
+{
+        return S_ISDIR(mode) || S_ISREG(mode);
+}
+
+static int scan_dir(const char *dir_path, const char *rel_path, struct tree *tree,
+                    struct scan_ctx *ctx)
+{
+        DIR *dir = opendir(dir_path);
+        if (!dir) {
+                perror("opendir");
+                return -1;
+        }
 
         struct dirent *entry;
         struct tree_entry *last_entry = NULL;
@@ -168,6 +306,14 @@ struct tree *form_tree(const char *dir_path)
                 snprintf(full_path, sizeof(full_path), "%s/%s", 
                         dir_path, entry->d_name);
 
+                char entry_rel_path[1024];
+                if (rel_path[0]) {
+                        snprintf(entry_rel_path, sizeof(entry_rel_path), "%s/%s",
+                                rel_path, entry->d_name);
+                } else {
+                        snprintf(entry_rel_path, sizeof(entry_rel_path), "%s", entry->d_name);
+                }
+
                 struct stat st;
                 if (lstat(full_path, &st) < 0) {
                         perror("lstat");
@@ -177,347 +323,1077 @@ struct tree *form_tree(const char *dir_path)
                 struct tree_entry *new_entry = NULL;
 
                 if (S_ISDIR(st.st_mode)) {
-                        struct tree *subdir_tree = form_tree(full_path);
+                        struct tree *subdir_tree = create_tree(ctx->arena, NULL);
                         if (!subdir_tree) {
                                 continue;
                         }
-                        new_entry = create_tree_entry(entry->d_name, NULL);
+                        new_entry = create_tree_entry(ctx->arena, entry->d_name, NULL);
                         if (!new_entry) {
-                                free_tree(subdir_tree);
                                 continue;
                         }
-                        strcpy(new_entry->type, "tree");
                         new_entry->subtree = subdir_tree;
+
+                        if (ctx->pool) {
+                                if (submit_scan_job(ctx, new_entry, full_path, entry_rel_path) != 0) {
+                                        free_tree(new_entry->subtree);
+                                        new_entry->subtree = NULL;
+                                }
+                        } else if (scan_dir(full_path, entry_rel_path, subdir_tree, ctx) != 0) {
+                                free_tree(new_entry->subtree);
+                                new_entry->subtree = NULL;
+                        }
                 } else if (S_ISREG(st.st_mode)) {
-                        struct blob *file_blob = create_blob(full_path);
+                        unsigned char cached_hash[SHA_DIGEST_LENGTH];
+                        size_t cached_size;
+                        int cached = index_lookup(ctx->idx, entry_rel_path, &st, cached_hash, &cached_size) &&
+                                     object_exists(cached_hash);
+                        struct blob *file_blob;
+
+                        if (cached) {
+                                file_blob = create_cached_blob(ctx->arena, &st, cached_hash, cached_size);
+                        } else if (ctx->pipeline) {
+                                // Hash and stored size are filled in by the pipeline
+                                memset(cached_hash, 0, sizeof(cached_hash));
+                                file_blob = create_cached_blob(ctx->arena, &st, cached_hash, 0);
+                        } else {
+                                file_blob = create_blob(ctx->arena, full_path);
+                        }
                         if (!file_blob) {
                                 continue;
                         }
-                        new_entry = create_tree_entry(entry->d_name, file_blob);
+                        new_entry = create_tree_entry(ctx->arena, entry->d_name, file_blob);
                         if (!new_entry) {
-                                free(file_blob->data);
-                                free(file_blob);
                                 continue;
                         }
+
+                        if (!cached && ctx->pipeline) {
+                                if (pipeline_submit(ctx->pipeline, full_path, entry_rel_path,
+                                                    &st, new_entry, ctx->idx) != 0) {
+                                        free_tree_entry(new_entry);
+                                        continue;
+                                }
+                        } else {
+                                index_update(ctx->idx, entry_rel_path, &st, file_blob->hash, file_blob->compressed_size);
+                        }
                 }
 
                 if (new_entry) {
                         if (last_entry) {
                                 last_entry->next = new_entry;
                         } else {
-                                root_tree->entries = new_entry;
+                                tree->entries = new_entry;
                         }
                         last_entry = new_entry;
-                        root_tree->entry_count++;
+                        tree->entry_count++;
                 }
         }
 
         closedir(dir);
+        return sort_tree_entries(tree);
+}
 
-        // Calculate tree hash
-        FILE *tmp_file = tmpfile();
-        if (!tmp_file) {
-                perror("tmpfile");
-                free_tree(root_tree);
-                return NULL;
+static void scan_job_run(void *arg)
+{
+        struct scan_job *job = arg;
+
+        if (scan_dir(job->dir_path, job->rel_path, job->entry->subtree, job->ctx) != 0) {
+                free_tree(job->entry->subtree);
+                job->entry->subtree = NULL;
         }
 
-        if (serialize_tree(tmp_file, root_tree) != 0) {
-                fclose(tmp_file);
-                free_tree(root_tree);
-                return NULL;
+        free(job->dir_path);
+        free(job->rel_path);
+        free(job);
+}
+
+// Drops unreadable entries and computes Merkle hashes bottom-up
+static int finish_tree(struct tree *tree)
+{
+        struct tree_entry **current = &tree->entries;
+
+        while (*current) {
+                struct tree_entry *entry = *current;
+                int failed = 0;
+
+                if (entry->type == ENTRY_TREE) {
+                        failed = !entry->subtree || finish_tree(entry->subtree) != 0;
+                } else if (entry->type == ENTRY_BLOB) {
+                        failed = !entry->blob;
+                }
+
+                if (failed) {
+                        *current = entry->next;
+                        free_tree_entry(entry);
+                        tree->entry_count--;
+                        continue;
+                }
+                current = &entry->next;
         }
 
-        fseek(tmp_file, 0, SEEK_END);
-        size_t size = ftell(tmp_file);
-        fseek(tmp_file, 0, SEEK_SET);
+        return hash_tree(tree);
+}
 
-        unsigned char *buffer = malloc(size);
-        if (!buffer) {
-                perror("malloc");
-                fclose(tmp_file);
-                free_tree(root_tree);
-                return NULL;
+static struct pipeline *create_pipeline(void)
+{
+        int threads = config.threads;
+        int readers = config.readers > 0 ? config.readers : threads;
+        int hashers = config.hashers > 0 ? config.hashers : (threads + 1) / 2;
+        int compressors = config.compressors > 0 ? config.compressors : threads;
+        size_t depth = config.queue_depth > 0 ? (size_t)config.queue_depth : (size_t)threads * 4;
+
+        return pipeline_create(readers, hashers, compressors, depth);
+}
+
+/*
+ * Scans dir_path into a tree. When idx is given, files whose stat data
+ * matches the cache reuse the recorded hash instead of being read. With
+ * config.threads > 1 subdirectories are scanned by a work-stealing pool and
+ * file contents go through the read/hash/compress pipeline; the resulting
+ * tree is identical to the serial walk.
+ */
+struct tree *form_tree(const char *dir_path, struct index *idx)
+{
+        struct tree *root_tree = create_tree(NULL, NULL);
+        if (!root_tree) return NULL;
+
+        struct scan_ctx ctx = { .arena = root_tree->arena, .idx = idx, .pool = NULL, .pipeline = NULL };
+        if (config.threads > 1) {
+                ctx.pool = pool_create(config.threads);
+                ctx.pipeline = create_pipeline();
         }
 
-        if (fread(buffer, 1, size, tmp_file) != size) {
-                perror("fread");
-                free(buffer);
-                fclose(tmp_file);
-                free_tree(root_tree);
-                return NULL;
+        int ret = scan_dir(dir_path, "", root_tree, &ctx);
+
+        if (ctx.pool) {
+                pool_wait(ctx.pool);
+                pool_destroy(ctx.pool);
         }
 
-        SHA1(buffer, size, root_tree->hash);
+        if (ctx.pipeline) {
+                pipeline_finish(ctx.pipeline);
+                if (config.stats) {
+                        pipeline_print_stats(ctx.pipeline, stdout);
+                }
+                pipeline_destroy(ctx.pipeline);
+        }
 
-        free(buffer);
-        fclose(tmp_file);
+        if (ret != 0 || finish_tree(root_tree) != 0) {
+                free_tree(root_tree);
+                return NULL;
+        }
 
         return root_tree;
 }
 
-void free_tree_entry(struct tree_entry *entry) 
+/*
+ * Merkle hash of a single directory level: covers each child's mode, type,
+ * name and hash. Subtrees must already carry their own hash, so the cost is
+ * proportional to the number of entries, never to the size of the data.
+ */
+int hash_tree(struct tree *tree)
 {
-        if (!entry) return;
+        if (!tree) return -1;
 
-        if (entry->subtree) {
-                free_tree(entry->subtree);
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) != 1) {
+                EVP_MD_CTX_free(ctx);
+                return -1;
         }
 
-        if (entry->blob) {
-                free(entry->blob->data);
-                free(entry->blob);
+        struct tree_entry *entry = tree->entries;
+        while (entry) {
+                if (entry->subtree) {
+                        memcpy(entry->hash, entry->subtree->hash, SHA_DIGEST_LENGTH);
+                } else if (entry->blob) {
+                        memcpy(entry->hash, entry->blob->hash, SHA_DIGEST_LENGTH);
+                }
+
+                // Same bytes as when mode and type were stored as strings
+                char mode[8];
+                const char *type = entry_type_name(entry->type);
+                snprintf(mode, sizeof(mode), "%06o", (unsigned int)entry->mode);
+
+                EVP_DigestUpdate(ctx, mode, strlen(mode) + 1);
+                EVP_DigestUpdate(ctx, type, strlen(type) + 1);
+                EVP_DigestUpdate(ctx, entry->name, entry->name_len + 1);
+                EVP_DigestUpdate(ctx, entry->hash, SHA_DIGEST_LENGTH);
+                entry = entry->next;
         }
 
-        if (entry->delta) {
-                free(entry->delta->added_data);
-                free(entry->delta->deleted_data);
-                free(entry->delta);
+        int ret = EVP_DigestFinal_ex(ctx, tree->hash, NULL) == 1 ? 0 : -1;
+        EVP_MD_CTX_free(ctx);
+        return ret;
+}
+
+/*
+ * Node reference counts only record sharing, for copy-on-write; memory is
+ * reclaimed a whole arena at a time. Callers that link a node into a tree
+ * living in another arena must also arena_hold() the node's arena.
+ */
+const char *entry_type_name(enum entry_type type)
+{
+        return type == ENTRY_TREE ? "tree" : "blob";
+}
+
+// Copies a name of len bytes into arena, NUL-terminated
+const char *arena_name(struct arena *arena, const char *name, size_t len)
+{
+        char *copy = arena_alloc(arena, len + 1);
+        if (copy) memcpy(copy, name, len);
+        return copy;
+}
+
+struct blob *blob_ref(struct blob *blob)
+{
+        if (blob) blob->refs++;
+        return blob;
+}
+
+void free_blob(struct blob *blob)
+{
+        if (blob) blob->refs--;
+}
+
+struct tree *tree_ref(struct tree *tree)
+{
+        if (tree) tree->refs++;
+        return tree;
+}
+
+/*
+ * Returns a tree that can be modified in place: tree itself if nothing else
+ * holds it, or else a copy of this one node, in the same arena, whose
+ * entries share their blobs and subtrees with the original.
+ */
+struct tree *unshare_tree(struct tree *tree)
+{
+        if (!tree || tree->refs == 1) return tree;
+
+        struct tree *copy = create_tree(tree->arena, NULL);
+        if (!copy) return NULL;
+
+        memcpy(copy->hash, tree->hash, sizeof(tree->hash));
+
+        struct tree_entry **last = &copy->entries;
+        for (struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                *last = clone_tree_entry(tree->arena, entry);
+                if (!*last) return NULL;
+                last = &(*last)->next;
+                copy->entry_count++;
         }
 
-        free(entry);
+        tree->refs--;
+        return copy;
 }
 
-void free_tree_entries(struct tree_entry *entry) 
+/*
+ * Open-addressed table from entry name to the link pointing at the entry,
+ * either tree->entries or the previous entry's next field. Keeping links
+ * rather than entries lets remove_tree_entry() unlink in O(1) and
+ * merge_tree_entries() insert in place. Everything lives in the tree's arena; tables
+ * outgrown by a resize are left there until the arena is released.
+ */
+struct entry_slot {
+        uint32_t hash;
+        struct tree_entry **link;
+};
+
+struct entry_index {
+        struct entry_slot *slots;
+        size_t slot_count;
+        size_t count;
+        // The same entries in list order, searched to find where a name goes
+        struct tree_entry **order;
+        size_t order_capacity;
+};
+
+static uint32_t hash_name(const char *name, size_t len)
 {
-        while (entry) {
-                struct tree_entry *next = entry->next;
-                free_tree_entry(entry);
-                entry = next;
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+                h ^= (unsigned char)name[i];
+                h *= 16777619u;
         }
+        return h;
 }
 
-void free_tree(struct tree *t) 
+static struct entry_slot *find_slot(struct entry_index *index, const char *name,
+                                    size_t len, uint32_t hash)
 {
-        if (!t) return;
-        free_tree_entries(t->entries);
-        free(t);
+        size_t mask = index->slot_count - 1;
+        size_t i = hash & mask;
+
+        while (index->slots[i].link) {
+                const struct tree_entry *entry = *index->slots[i].link;
+                if (index->slots[i].hash == hash && entry->name_len == len &&
+                    memcmp(entry->name, name, len) == 0) {
+                        break;
+                }
+                i = (i + 1) & mask;
+        }
+        return &index->slots[i];
 }
 
-int serialize_tree(FILE *out, struct tree *tree) 
+static int resize_index(struct tree *tree, struct entry_index *index, size_t slot_count)
 {
-        if (!tree || !out) return -1;
+        struct entry_slot *old = index->slots;
+        size_t old_count = index->slot_count;
 
-        if (fwrite(&tree->type, sizeof(tree->type), 1, out) != 1 ||
-            fwrite(&tree->entry_count, sizeof(tree->entry_count), 1, out) != 1) {
+        index->slots = arena_alloc(tree->arena, slot_count * sizeof(struct entry_slot));
+        if (!index->slots) {
+                index->slots = old;
                 return -1;
         }
+        index->slot_count = slot_count;
 
-        struct tree_entry *entry = tree->entries;
-        while (entry) {
-                if (fwrite(entry->mode, sizeof(entry->mode), 1, out) != 1 ||
-                    fwrite(&entry->type, sizeof(entry->type), 1, out) != 1 ||
-                    fwrite(entry->name, sizeof(entry->name), 1, out) != 1 ||
-                    fwrite(entry->hash, sizeof(entry->hash), 1, out) != 1) {
-                        return -1;
-                }
+        for (size_t i = 0; i < old_count; i++) {
+                if (!old[i].link) continue;
 
-                if (strcmp(entry->type, "blob") == 0 && entry->blob) {
-                        if (fwrite(&entry->blob->size, sizeof(entry->blob->size), 1, out) != 1 ||
-                            fwrite(&entry->blob->compressed_size, sizeof(entry->blob->compressed_size), 1, out) != 1 ||
-                            fwrite(entry->blob->data, 1, entry->blob->compressed_size, out) != entry->blob->compressed_size ||
-                            fwrite(&entry->blob->mode, sizeof(entry->blob->mode), 1, out) != 1 ||
-                            fwrite(&entry->blob->uid, sizeof(entry->blob->uid), 1, out) != 1 ||
-                            fwrite(&entry->blob->gid, sizeof(entry->blob->gid), 1, out) != 1 ||
-                            fwrite(&entry->blob->atime, sizeof(entry->blob->atime), 1, out) != 1 ||
-                            fwrite(&entry->blob->mtime, sizeof(entry->blob->mtime), 1, out) != 1 ||
-                            fwrite(&entry->blob->ctime, sizeof(entry->blob->ctime), 1, out) != 1) {
-                                return -1;
-                        }
+                size_t j = old[i].hash & (slot_count - 1);
+                while (index->slots[j].link) {
+                        j = (j + 1) & (slot_count - 1);
                 }
-                else if (strcmp(entry->type, "tree") == 0 && entry->subtree) {
-                        if (serialize_tree(out, entry->subtree) != 0) {
-                                return -1;
-                        }
+                index->slots[j] = old[i];
+        }
+        return 0;
+}
+
+static int index_link(struct tree *tree, struct entry_index *index, struct tree_entry **link)
+{
+        if ((index->count + 1) * 2 > index->slot_count &&
+            resize_index(tree, index, index->slot_count * 2) != 0) {
+                return -1;
+        }
+
+        const struct tree_entry *entry = *link;
+        uint32_t hash = hash_name(entry->name, entry->name_len);
+        struct entry_slot *slot = find_slot(index, entry->name, entry->name_len, hash);
+
+        if (!slot->link) index->count++;
+        slot->hash = hash;
+        slot->link = link;
+        return 0;
+}
+
+// Empties slot, shifting later entries of its probe run back into the gap
+static void unindex_slot(struct entry_index *index, struct entry_slot *slot)
+{
+        size_t mask = index->slot_count - 1;
+        size_t i = slot - index->slots;
+        size_t j = i;
+
+        for (;;) {
+                j = (j + 1) & mask;
+                if (!index->slots[j].link) break;
+
+                size_t home = index->slots[j].hash & mask;
+                if ((j > i && (home <= i || home > j)) ||
+                    (j < i && home <= i && home > j)) {
+                        index->slots[i] = index->slots[j];
+                        i = j;
                 }
-                entry = entry->next;
         }
+
+        index->slots[i].link = NULL;
+        index->count--;
+}
+
+// Makes room in index->order for count entries
+static int reserve_order(struct tree *tree, struct entry_index *index, size_t count)
+{
+        if (count <= index->order_capacity) return 0;
+
+        size_t capacity = index->order_capacity ? index->order_capacity * 2 : 16;
+        while (capacity < count) {
+                capacity *= 2;
+        }
+
+        struct tree_entry **order = arena_alloc(tree->arena, capacity * sizeof(*order));
+        if (!order) return -1;
+
+        if (index->order) memcpy(order, index->order, index->count * sizeof(*order));
+        index->order = order;
+        index->order_capacity = capacity;
         return 0;
 }
 
-int deserialize_tree(FILE *in, struct tree **tree) 
+// Position in index->order of the first entry whose name does not sort before name
+static size_t order_position(const struct entry_index *index, const char *name)
 {
-        if (!in || !tree) return -1;
+        size_t lo = 0, hi = index->count;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (strcmp(index->order[mid]->name, name) < 0) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo;
+}
 
-        *tree = malloc(sizeof(struct tree));
-        if (!*tree) return -1;
+static struct entry_index *get_entry_index(struct tree *tree)
+{
+        if (tree->index) return tree->index;
 
-        if (fread(&(*tree)->type, sizeof((*tree)->type), 1, in) != 1 ||
-            fread(&(*tree)->entry_count, sizeof((*tree)->entry_count), 1, in) != 1) {
-                free(*tree);
-                *tree = NULL;
-                return -1;
+        struct entry_index *index = arena_alloc(tree->arena, sizeof(struct entry_index));
+        if (!index) return NULL;
+
+        size_t slot_count = 16;
+        while (slot_count < tree->entry_count * 2) {
+                slot_count *= 2;
         }
+        if (resize_index(tree, index, slot_count) != 0) return NULL;
 
-        (*tree)->entries = NULL;
-        struct tree_entry **last_entry = &(*tree)->entries;
+        struct tree_entry **link = &tree->entries;
+        while (*link) {
+                if (index_link(tree, index, link) != 0) return NULL;
+                link = &(*link)->next;
+        }
 
-        for (size_t i = 0; i < (*tree)->entry_count; i++) {
-                struct tree_entry *entry = malloc(sizeof(struct tree_entry));
-                if (!entry) {
-                        free_tree(*tree);
-                        *tree = NULL;
+        // Trees are kept in name order, so the list order is the search order
+        if (reserve_order(tree, index, index->count) != 0) return NULL;
+        size_t i = 0;
+        for (struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
+                index->order[i++] = entry;
+        }
+
+        tree->index = index;
+        return index;
+}
+
+struct tree_entry *find_tree_entry(struct tree *tree, const char *name)
+{
+        struct entry_index *index = get_entry_index(tree);
+        if (!index) return NULL;
+
+        size_t len = strlen(name);
+        struct entry_slot *slot = find_slot(index, name, len, hash_name(name, len));
+        return slot->link ? *slot->link : NULL;
+}
+
+// Only valid while the entry is still reached through the link in its slot
+static struct entry_slot *entry_slot(struct entry_index *index, const struct tree_entry *entry)
+{
+        return find_slot(index, entry->name, entry->name_len,
+                         hash_name(entry->name, entry->name_len));
+}
+
+/*
+ * Links each entry of list into tree at its place in name order. The place
+ * is found by binary search over the index's ordered array, so the list
+ * needs no particular order and the tree is never walked. Fails on a name
+ * that is already present.
+ */
+int merge_tree_entries(struct tree *tree, struct tree_entry *list)
+{
+        struct entry_index *index = get_entry_index(tree);
+        if (!index) return -1;
+
+        while (list) {
+                struct tree_entry *entry = list;
+                list = list->next;
+
+                size_t pos = order_position(index, entry->name);
+                if (pos < index->count && strcmp(index->order[pos]->name, entry->name) == 0) {
+                        fprintf(stderr, "Duplicate entry '%s'\n", entry->name);
                         return -1;
                 }
-                entry->next = NULL;
-                entry->blob = NULL;
-                entry->subtree = NULL;
-                entry->delta = NULL;
-
-                if (fread(entry->mode, sizeof(entry->mode), 1, in) != 1 ||
-                    fread(&entry->type, sizeof(entry->type), 1, in) != 1 ||
-                    fread(entry->name, sizeof(entry->name), 1, in) != 1 ||
-                    fread(entry->hash, sizeof(entry->hash), 1, in) != 1) {
-                        free(entry);
-                        free_tree(*tree);
-                        *tree = NULL;
+                if (reserve_order(tree, index, index->count + 1) != 0) return -1;
+
+                struct tree_entry **link = pos ? &index->order[pos - 1]->next : &tree->entries;
+                struct entry_slot *next_slot = *link ? entry_slot(index, *link) : NULL;
+
+                entry->next = *link;
+                *link = entry;
+                if (next_slot) next_slot->link = &entry->next;
+
+                if (index_link(tree, index, link) != 0) {
+                        if (next_slot) next_slot->link = link;
+                        *link = entry->next;
                         return -1;
                 }
 
-                if (strcmp(entry->type, "blob") == 0) {
-                        entry->blob = malloc(sizeof(struct blob));
-                        if (!entry->blob) {
-                                free(entry);
-                                free_tree(*tree);
-                                *tree = NULL;
-                                return -1;
-                        }
+                // index_link counted the entry; order still has the old length
+                memmove(&index->order[pos + 1], &index->order[pos],
+                        (index->count - 1 - pos) * sizeof(*index->order));
+                index->order[pos] = entry;
+                tree->entry_count++;
+        }
+        return 0;
+}
 
-                        if (fread(&entry->blob->size, sizeof(entry->blob->size), 1, in) != 1 ||
-                            fread(&entry->blob->compressed_size, sizeof(entry->blob->compressed_size), 1, in) != 1) {
-                                free(entry->blob);
-                                free(entry);
-                                free_tree(*tree);
-                                *tree = NULL;
-                                return -1;
-                        }
+// Unlinks and returns the named entry; the caller releases it
+struct tree_entry *remove_tree_entry(struct tree *tree, const char *name)
+{
+        struct entry_index *index = get_entry_index(tree);
+        if (!index) return NULL;
 
-                        entry->blob->data = malloc(entry->blob->compressed_size);
-                        if (!entry->blob->data) {
-                                free(entry->blob);
-                                free(entry);
-                                free_tree(*tree);
-                                *tree = NULL;
-                                return -1;
-                        }
+        size_t len = strlen(name);
+        struct entry_slot *slot = find_slot(index, name, len, hash_name(name, len));
+        if (!slot->link) return NULL;
 
-                        if (fread(entry->blob->data, 1, entry->blob->compressed_size, in) != entry->blob->compressed_size ||
-                            fread(&entry->blob->mode, sizeof(entry->blob->mode), 1, in) != 1 ||
-                            fread(&entry->blob->uid, sizeof(entry->blob->uid), 1, in) != 1 ||
-                            fread(&entry->blob->gid, sizeof(entry->blob->gid), 1, in) != 1 ||
-                            fread(&entry->blob->atime, sizeof(entry->blob->atime), 1, in) != 1 ||
-                            fread(&entry->blob->mtime, sizeof(entry->blob->mtime), 1, in) != 1 ||
-                            fread(&entry->blob->ctime, sizeof(entry->blob->ctime), 1, in) != 1) {
-                                free(entry->blob->data);
-                                free(entry->blob);
-                                free(entry);
-                                free_tree(*tree);
-                                *tree = NULL;
-                                return -1;
-                        }
+        struct tree_entry **link = slot->link;
+        struct tree_entry *entry = *link;
+
+        size_t pos = order_position(index, entry->name);
+        memmove(&index->order[pos], &index->order[pos + 1],
+                (index->count - 1 - pos) * sizeof(*index->order));
+        unindex_slot(index, slot);
+
+        // The following entry is now reached through the removed entry's link
+        if (entry->next) entry_slot(index, entry->next)->link = link;
+
+        *link = entry->next;
+        entry->next = NULL;
+        tree->entry_count--;
+        return entry;
+}
+
+void free_tree_entry(struct tree_entry *entry) 
+{
+        if (!entry) return;
+
+        free_tree(entry->subtree);
+        free_blob(entry->blob);
+}
+
+void free_tree_entries(struct tree_entry *entry) 
+{
+        for (; entry; entry = entry->next) {
+                free_tree_entry(entry);
+        }
+}
+
+// Dropping a root tree releases its arena without walking the nodes
+void free_tree(struct tree *t) 
+{
+        if (!t) return;
+
+        t->refs--;
+        if (t->owns_arena) arena_unref(t->arena);
+}
+
+// Entry kinds as stored on disk
+enum {
+        ENCODED_BLOB = 0,
+        ENCODED_TREE = 1,
+};
+
+static void encode_timespec(struct buffer *buf, const struct timespec *ts)
+{
+        buffer_put_svarint(buf, ts->tv_sec);
+        buffer_put_varint(buf, ts->tv_nsec);
+}
+
+static void decode_timespec(struct reader *rd, struct timespec *ts)
+{
+        ts->tv_sec = reader_get_svarint(rd);
+        ts->tv_nsec = reader_get_varint(rd);
+}
+
+/*
+ * Appends one entry: kind, octal mode as a varint, length-prefixed name and
+ * hash, followed by the blob's stat data or the entry's subtree.
+ */
+void encode_tree_entry(struct buffer *buf, const struct tree_entry *entry)
+{
+        int is_tree = entry->type == ENTRY_TREE;
+
+        buffer_put_u8(buf, is_tree ? ENCODED_TREE : ENCODED_BLOB);
+        buffer_put_varint(buf, entry->mode);
+        buffer_put_string(buf, entry->name);
+        buffer_put(buf, entry->hash, sizeof(entry->hash));
+
+        if (is_tree) {
+                if (entry->subtree) {
+                        encode_tree(buf, entry->subtree);
+                } else {
+                        buffer_put_varint(buf, 0);
                 }
-                else if (strcmp(entry->type, "tree") == 0) {
-                        if (deserialize_tree(in, &entry->subtree) != 0) {
-                                free(entry);
-                                free_tree(*tree);
-                                *tree = NULL;
-                                return -1;
-                        }
+        } else if (entry->blob) {
+                buffer_put_varint(buf, entry->blob->size);
+                buffer_put_varint(buf, entry->blob->compressed_size);
+                buffer_put_varint(buf, entry->blob->uid);
+                buffer_put_varint(buf, entry->blob->gid);
+                encode_timespec(buf, &entry->blob->atime);
+                encode_timespec(buf, &entry->blob->mtime);
+                encode_timespec(buf, &entry->blob->ctime);
+        }
+}
+
+void encode_tree(struct buffer *buf, const struct tree *tree)
+{
+        buffer_put_varint(buf, tree->entry_count);
+
+        const struct tree_entry *entry = tree->entries;
+        for (size_t i = 0; i < tree->entry_count && entry; i++) {
+                encode_tree_entry(buf, entry);
+                entry = entry->next;
+        }
+}
+
+struct tree_entry *decode_tree_entry(struct reader *rd, struct arena *arena)
+{
+        struct tree_entry *entry = arena_alloc(arena, sizeof(struct tree_entry));
+        if (!entry) return NULL;
+
+        char name[NAME_MAX + 1];
+        uint8_t kind = reader_get_u8(rd);
+        uint64_t mode = reader_get_varint(rd);
+        reader_get_string(rd, name, sizeof(name));
+        reader_get(rd, entry->hash, sizeof(entry->hash));
+
+        if (rd->failed) return NULL;
+
+        entry->mode = mode;
+        entry->name_len = strlen(name);
+        entry->name = arena_name(arena, name, entry->name_len);
+        if (!entry->name) return NULL;
+
+        if (kind == ENCODED_TREE) {
+                entry->type = ENTRY_TREE;
+                if (decode_tree(rd, arena, &entry->subtree) != 0) return NULL;
+                return entry;
+        }
+
+        if (kind != ENCODED_BLOB) return NULL;
+
+        entry->type = ENTRY_BLOB;
+        entry->blob = alloc_blob(arena);
+        if (!entry->blob) return NULL;
+
+        memcpy(entry->blob->hash, entry->hash, sizeof(entry->hash));
+        entry->blob->mode = mode;
+        entry->blob->size = reader_get_varint(rd);
+        entry->blob->compressed_size = reader_get_varint(rd);
+        entry->blob->uid = reader_get_varint(rd);
+        entry->blob->gid = reader_get_varint(rd);
+        decode_timespec(rd, &entry->blob->atime);
+        decode_timespec(rd, &entry->blob->mtime);
+        decode_timespec(rd, &entry->blob->ctime);
+
+        return rd->failed ? NULL : entry;
+}
+
+// With a NULL arena the decoded tree is a root that owns a new arena
+int decode_tree(struct reader *rd, struct arena *arena, struct tree **tree)
+{
+        uint64_t count = reader_get_varint(rd);
+        if (rd->failed) return -1;
+
+        *tree = create_tree(arena, NULL);
+        if (!*tree) return -1;
+        arena = (*tree)->arena;
+
+        struct tree_entry **last_entry = &(*tree)->entries;
+        for (uint64_t i = 0; i < count; i++) {
+                struct tree_entry *entry = decode_tree_entry(rd, arena);
+                if (!entry) {
+                        free_tree(*tree);
+                        *tree = NULL;
+                        return -1;
                 }
 
                 *last_entry = entry;
                 last_entry = &entry->next;
+                (*tree)->entry_count++;
+        }
+
+        // Trees stored before entries were sorted come back in readdir order
+        if (sort_tree_entries(*tree) != 0 || hash_tree(*tree) != 0) {
+                free_tree(*tree);
+                *tree = NULL;
+                return -1;
         }
         return 0;
 }
 
-int restore_directory(struct tree *tree, const char *dir_path) 
+// Writes the tree as a length-prefixed record in a single fwrite
+int serialize_tree(FILE *out, struct tree *tree)
 {
-        if (!tree || !dir_path) {
-                fprintf(stderr, "Invalid arguments to restore_directory\n");
+        if (!tree || !out) return -1;
+
+        struct buffer body, buf;
+        buffer_init(&body);
+        buffer_init(&buf);
+
+        encode_tree(&body, tree);
+        buffer_put_varint(&buf, body.len);
+        buffer_put(&buf, body.data, body.len);
+
+        int ret = body.failed ? -1 : buffer_write(&buf, out);
+        buffer_free(&body);
+        buffer_free(&buf);
+        return ret;
+}
+
+int deserialize_tree(FILE *in, struct tree **tree)
+{
+        if (!in || !tree) return -1;
+
+        uint64_t len = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+                int c = fgetc(in);
+                if (c == EOF) return -1;
+                len |= (uint64_t)(c & 0x7f) << shift;
+                if (!(c & 0x80)) break;
+        }
+
+        unsigned char *data = malloc(len ? len : 1);
+        if (!data) {
+                perror("malloc");
                 return -1;
         }
 
-        if (mkdir(dir_path, 0777) < 0 && errno != EEXIST) {
-                perror("mkdir");
+        if (fread(data, 1, len, in) != len) {
+                free(data);
                 return -1;
         }
 
-        struct tree_entry *entry = tree->entries;
-        while (entry) {
+        struct reader rd;
+        reader_init(&rd, data, len);
+        int ret = decode_tree(&rd, NULL, tree);
+        free(data);
+        return ret;
+}
+
+struct restore_ctx {
+        struct pool *pool;
+        pthread_mutex_t lock;
+        size_t failures;
+        int incremental;
+        size_t written;
+        size_t unchanged;
+        size_t removed;
+};
+
+struct restore_job {
+        struct restore_ctx *ctx;
+        const struct tree_entry *entry;
+        char *path;
+};
+
+// Writes the file's contents, then its mode, owner and times
+static int restore_file(const struct tree_entry *entry, const char *full_path)
+{
+        if (!entry->blob) {
+                fprintf(stderr, "Invalid blob for entry %s\n", entry->name);
+                return -1;
+        }
+
+        FILE *file = fopen(full_path, "wb");
+        if (!file) {
+                perror("fopen");
+                return -1;
+        }
+
+        if (copy_object_to_file(entry->hash, file) != 0) {
+                fprintf(stderr, "Failed to restore contents of %s\n", entry->name);
+                fclose(file);
+                return -1;
+        }
+        fclose(file);
+
+        if (chmod(full_path, entry->blob->mode) < 0) {
+                perror("chmod");
+                return -1;
+        }
+
+        if (chown(full_path, entry->blob->uid, entry->blob->gid) < 0) {
+                perror("chown");
+        }
+
+        struct timespec times[2] = {entry->blob->atime, entry->blob->mtime};
+        if (utimensat(0, full_path, times, 0) < 0) {
+                perror("utimensat");
+                return -1;
+        }
+        return 0;
+}
+
+static void restore_job_run(void *arg)
+{
+        struct restore_job *job = arg;
+
+        if (restore_file(job->entry, job->path) != 0) {
+                pthread_mutex_lock(&job->ctx->lock);
+                job->ctx->failures++;
+                pthread_mutex_unlock(&job->ctx->lock);
+        }
+
+        free(job->path);
+        free(job);
+}
+
+static int submit_restore_job(struct restore_ctx *ctx, const struct tree_entry *entry,
+                              const char *full_path)
+{
+        struct restore_job *job = malloc(sizeof(struct restore_job));
+        if (!job) {
+                perror("malloc");
+                return -1;
+        }
+
+        job->ctx = ctx;
+        job->entry = entry;
+        job->path = strdup(full_path);
+        if (!job->path || pool_submit(ctx->pool, restore_job_run, job) != 0) {
+                free(job->path);
+                free(job);
+                return -1;
+        }
+        return 0;
+}
+
+// Removes whatever is at path without following symlinks
+static int remove_path(const char *path)
+{
+        struct stat st;
+        if (lstat(path, &st) < 0) return -1;
+        return S_ISDIR(st.st_mode) ? remove_dir(path) : unlink(path);
+}
+
+static int make_directory(const char *dir_path, struct restore_ctx *ctx)
+{
+        if (mkdir(dir_path, 0777) == 0) return 0;
+
+        struct stat st;
+        if (errno == EEXIST && ctx->incremental &&
+            lstat(dir_path, &st) == 0 && !S_ISDIR(st.st_mode)) {
+                if (remove_path(dir_path) == 0 && mkdir(dir_path, 0777) == 0) return 0;
+        } else if (errno == EEXIST) {
+                return 0;
+        }
+
+        perror("mkdir");
+        return -1;
+}
+
+/*
+ * Deletes what dir_path holds beyond the entries of tree. Symlinks and
+ * other special files are kept: a snapshot never records them, so their
+ * absence from the tree says nothing.
+ */
+static void remove_extraneous(struct tree *tree, const char *dir_path, struct restore_ctx *ctx)
+{
+        DIR *dir = opendir(dir_path);
+        if (!dir) return;
+
+        struct dirent *d;
+        while ((d = readdir(dir)) != NULL) {
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 ||
+                    find_tree_entry(tree, d->d_name)) {
+                        continue;
+                }
+
+                char full_path[1024];
+                struct stat st;
+                snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, d->d_name);
+                if (lstat(full_path, &st) != 0 || !is_snapshot_type(st.st_mode)) continue;
+
+                if (remove_path(full_path) != 0) {
+                        perror("remove");
+                        continue;
+                }
+                ctx->removed++;
+        }
+
+        closedir(dir);
+}
+
+/*
+ * A file whose size and mtime match the blob is taken to hold its contents,
+ * the same test the snapshot stat cache relies on. Only its mode and owner
+ * are corrected.
+ */
+static int keep_file(const struct blob *blob, const char *full_path, const struct stat *st)
+{
+        if (!S_ISREG(st->st_mode) || (size_t)st->st_size != blob->size ||
+            st->st_mtim.tv_sec != blob->mtime.tv_sec ||
+            st->st_mtim.tv_nsec != blob->mtime.tv_nsec) {
+                return 0;
+        }
+
+        if ((st->st_mode & 07777) != (blob->mode & 07777) && chmod(full_path, blob->mode) < 0) {
+                perror("chmod");
+        }
+        if ((st->st_uid != blob->uid || st->st_gid != blob->gid) &&
+            chown(full_path, blob->uid, blob->gid) < 0) {
+                perror("chown");
+        }
+        return 1;
+}
+
+static int restore_blob(const struct tree_entry *entry, const char *full_path,
+                        struct restore_ctx *ctx)
+{
+        struct stat st;
+        if (ctx->incremental && entry->blob && lstat(full_path, &st) == 0) {
+                if (keep_file(entry->blob, full_path, &st)) {
+                        ctx->unchanged++;
+                        return 0;
+                }
+
+                // Never write through a symlink or onto a directory
+                if (!S_ISREG(st.st_mode) && remove_path(full_path) != 0) {
+                        perror("remove");
+                        return -1;
+                }
+        }
+
+        if (ctx->pool) {
+                if (submit_restore_job(ctx, entry, full_path) != 0) return -1;
+        } else if (restore_file(entry, full_path) != 0) {
+                return -1;
+        }
+        ctx->written++;
+        return 0;
+}
+
+/*
+ * Creates dir_path and its subdirectories. Each directory exists before any
+ * of its files is written; with a pool the files are handed to it and
+ * written while the walk goes on. An incremental restore first deletes
+ * entries the tree does not have, then skips files that already match.
+ */
+static int restore_tree(struct tree *tree, const char *dir_path, struct restore_ctx *ctx)
+{
+        if (make_directory(dir_path, ctx) != 0) return -1;
+
+        if (ctx->incremental) remove_extraneous(tree, dir_path, ctx);
+
+        for (struct tree_entry *entry = tree->entries; entry; entry = entry->next) {
                 char full_path[1024];
                 snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->name);
 
-                if (strcmp(entry->type, "tree") == 0) {
-                        if (entry->subtree) {
-                                if (restore_directory(entry->subtree, full_path) != 0) {
-                                        return -1;
-                                }
-                        }
-                } else if (strcmp(entry->type, "blob") == 0) {
-                        if (!entry->blob) {
-                                fprintf(stderr, "Invalid blob for entry %s\n", entry->name);
+                if (entry->type == ENTRY_TREE) {
+                        if (entry->subtree && restore_tree(entry->subtree, full_path, ctx) != 0) {
                                 return -1;
                         }
+                } else if (entry->type == ENTRY_BLOB) {
+                        if (restore_blob(entry, full_path, ctx) != 0) return -1;
+                }
+        }
+        return 0;
+}
 
-                        unsigned char *write_data;
-                        size_t write_size;
+/*
+ * Looks up a slash-separated path one component at a time, using each
+ * tree's name index. Empty and "." components are skipped.
+ */
+struct tree_entry *find_tree_path(struct tree *tree, const char *path)
+{
+        struct tree_entry *entry = NULL;
+        const char *p = path;
 
-                        if (config.compress_files && entry->blob->size != entry->blob->compressed_size) {
-                                write_data = malloc(entry->blob->size);
-                                if (!write_data) return -1;
+        while (*p) {
+                size_t len = strcspn(p, "/");
+                if (len == 0 || (len == 1 && p[0] == '.')) {
+                        p += len + (p[len] == '/');
+                        continue;
+                }
 
-                                uLong uncomp_size = entry->blob->size;
-                                if (uncompress(write_data, &uncomp_size, entry->blob->data, 
-                                             entry->blob->compressed_size) != Z_OK) {
-                                        free(write_data);
-                                        return -1;
-                                }
-                                write_size = uncomp_size;
-                        } else {
-                                write_data = entry->blob->data;
-                                write_size = entry->blob->size;
-                        }
+                char name[NAME_MAX + 1];
+                if (!tree || len > NAME_MAX) return NULL;
+                memcpy(name, p, len);
+                name[len] = '\0';
 
-                        FILE *file = fopen(full_path, "wb");
-                        if (!file) {
-                                if (config.compress_files && write_data != entry->blob->data) 
-                                        free(write_data);
-                                perror("fopen");
-                                return -1;
-                        }
-                        
-                        if (fwrite(write_data, 1, write_size, file) != write_size) {
-                                if (config.compress_files && write_data != entry->blob->data) 
-                                        free(write_data);
-                                perror("fwrite");
-                                fclose(file);
-                                return -1;
-                        }
+                entry = find_tree_entry(tree, name);
+                if (!entry) return NULL;
 
-                        if (config.compress_files && write_data != entry->blob->data) {
-                                free(write_data);
-                        }
-                        fclose(file);
+                tree = entry->type == ENTRY_TREE ? entry->subtree : NULL;
+                p += len + (p[len] == '/');
+        }
+        return entry;
+}
+
+/*
+ * Writes only the entry at rel_path, creating the directories leading to
+ * it below dir_path. Those parents are never cleaned, even incrementally;
+ * only the restored subtree is brought in line with the revision.
+ */
+static int restore_path(struct tree *tree, const char *dir_path, const char *rel_path,
+                        struct restore_ctx *ctx)
+{
+        struct tree_entry *entry = find_tree_path(tree, rel_path);
+        if (!entry) {
+                fprintf(stderr, "No such path in revision: %s\n", rel_path);
+                return -1;
+        }
 
-                        if (chmod(full_path, entry->blob->mode) < 0) {
-                                perror("chmod");
+        char full_path[1024];
+        snprintf(full_path, sizeof(full_path), "%s", dir_path);
+        if (make_directory(full_path, ctx) != 0) return -1;
+
+        const char *p = rel_path;
+        while (*p) {
+                size_t len = strcspn(p, "/");
+                if (len > 0 && !(len == 1 && p[0] == '.')) {
+                        size_t used = strlen(full_path);
+                        if (used + len + 2 > sizeof(full_path)) {
+                                fprintf(stderr, "Path too long: %s\n", rel_path);
                                 return -1;
                         }
-                        
-                        if (chown(full_path, entry->blob->uid, entry->blob->gid) < 0) {
-                                perror("chown");
-                        }
+                        snprintf(full_path + used, sizeof(full_path) - used, "/%.*s", (int)len, p);
 
-                        struct timespec times[2] = {entry->blob->atime, entry->blob->mtime};
-                        if (utimensat(0, full_path, times, 0) < 0) {
-                                perror("utimensat");
-                                return -1;
+                        // The last component is the entry itself
+                        const char *rest = p + len;
+                        while (*rest == '/' || (rest[0] == '.' && (rest[1] == '/' || rest[1] == '\0'))) {
+                                rest++;
                         }
+                        if (*rest && make_directory(full_path, ctx) != 0) return -1;
                 }
-                entry = entry->next;
+                p += len + (p[len] == '/');
         }
-        return 0;
+
+        if (entry->type == ENTRY_TREE) {
+                return entry->subtree ? restore_tree(entry->subtree, full_path, ctx) : 0;
+        }
+        return restore_blob(entry, full_path, ctx);
+}
+
+/*
+ * Writes tree out below dir_path, or with rel_path set, only the file or
+ * subtree at that path. With config.threads > 1, file contents are
+ * decompressed and written by a pool of that many threads, the same
+ * setting the scanner uses. With config.incremental_restore, dir_path is
+ * brought in line with tree instead: only differing files are written and
+ * anything the tree lacks is deleted.
+ */
+int restore_directory(struct tree *tree, const char *dir_path, const char *rel_path)
+{
+        if (!tree || !dir_path) {
+                fprintf(stderr, "Invalid arguments to restore_directory\n");
+                return -1;
+        }
+
+        struct restore_ctx ctx = { .pool = NULL, .incremental = config.incremental_restore };
+        pthread_mutex_init(&ctx.lock, NULL);
+        if (config.threads > 1) {
+                ctx.pool = pool_create(config.threads);
+        }
+
+        int ret = rel_path && *rel_path ? restore_path(tree, dir_path, rel_path, &ctx)
+                                        : restore_tree(tree, dir_path, &ctx);
+
+        if (ctx.pool) {
+                pool_wait(ctx.pool);
+                pool_destroy(ctx.pool);
+        }
+        pthread_mutex_destroy(&ctx.lock);
+
+        if (ctx.incremental) {
+                printf("%zu files written, %zu unchanged, %zu removed\n",
+                       ctx.written, ctx.unchanged, ctx.removed);
+        }
+
+        if (ctx.failures > 0) {
+                fprintf(stderr, "Failed to restore %zu files\n", ctx.failures);
+                ret = -1;
+        }
+        return ret;
 }
 
 void print_indentation(int depth)
@@ -544,7 +1420,7 @@ int print_tree_entry(struct tree_entry *entry, int depth, int *total_entries)
         print_indentation(depth);
 
         // Print entry information
-        printf("%s %s %s ", entry->mode, entry->type, entry->name);
+        printf("%06o %s %s ", (unsigned int)entry->mode, entry_type_name(entry->type), entry->name);
 
         // Print hash in hex format
         for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
@@ -555,8 +1431,7 @@ int print_tree_entry(struct tree_entry *entry, int depth, int *total_entries)
         // If this entry has a blob, print its details
         if (entry->blob) {
                 print_indentation(depth + 1);
-                printf("Blob: type=%s size=%zu compressed=%zu\n", 
-                       entry->blob->type,
+                printf("Blob: type=blob size=%zu compressed=%zu\n", 
                        entry->blob->size,
                        entry->blob->compressed_size);
 
@@ -590,7 +1465,7 @@ int print_tree(struct tree *tree, int depth, int *total_entries)
                 }
 
                 print_indentation(depth);
-                printf("Tree: type=%s entries=%zu hash=", tree->type, tree->entry_count);
+                printf("Tree: type=tree entries=%zu hash=", tree->entry_count);
 
                 // Print tree hash
                 for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
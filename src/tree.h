@@ -6,13 +6,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdint.h>
 #include <openssl/sha.h>
 
+/*
+ * Nodes are allocated from the arena of the tree they were scanned or
+ * loaded into (see arena.h). Blobs and trees are reference counted so that
+ * clones, deltas and the trees rebuilt from them can share unchanged nodes.
+ * Shared nodes are treated as read-only; unshare_tree() gives a private
+ * copy to modify.
+ */
+
+enum entry_type {
+        ENTRY_BLOB,
+        ENTRY_TREE,
+};
+
 struct blob {
-        char type[5];
+        int refs;
+        struct arena *arena;
         size_t size;
         size_t compressed_size;
-        unsigned char *data;
+        unsigned char hash[SHA_DIGEST_LENGTH];
         mode_t mode;
         uid_t uid;
         gid_t gid;
@@ -22,10 +37,12 @@ struct blob {
         char *link_target;
 };
 
+// Names are stored in the arena of the tree holding the entry
 struct tree_entry {
-        char mode[7];
-        char type[7]; 
-        char name[256];
+        const char *name;
+        uint16_t name_len;
+        uint8_t type;
+        mode_t mode;
         unsigned char hash[SHA_DIGEST_LENGTH];
         struct file_delta *delta;
         struct tree *subtree;
@@ -34,23 +51,51 @@ struct tree_entry {
 };
 
 struct tree {
-        char type[5]; 
+        int refs;
+        struct arena *arena;
+        int owns_arena;
         size_t entry_count;
         unsigned char hash[SHA_DIGEST_LENGTH];
         struct tree_entry *entries;
+        // Name lookup, built on first use by the *_tree_entry() calls below
+        struct entry_index *index;
 };
 
-struct blob *create_blob(const char* file_path);
-struct tree_entry *create_tree_entry(const char *name, struct blob *blob);
-struct tree *create_tree(struct tree_entry *entry);
-struct tree *form_tree(const char *dir_path);
+struct index;
+struct arena;
+struct buffer;
+struct reader;
+
+struct blob *create_blob(struct arena *arena, const char* file_path);
+struct blob *create_cached_blob(struct arena *arena, const struct stat *st,
+                                const unsigned char *hash, size_t compressed_size);
+struct tree_entry *create_tree_entry(struct arena *arena, const char *name, struct blob *blob);
+struct tree *create_tree(struct arena *arena, struct tree_entry *entry);
+struct tree *form_tree(const char *dir_path, struct index *idx);
+int hash_tree(struct tree *tree);
+const char *entry_type_name(enum entry_type type);
+int is_snapshot_type(mode_t mode);
+const char *arena_name(struct arena *arena, const char *name, size_t len);
+struct blob *blob_ref(struct blob *blob);
+void free_blob(struct blob *blob);
+struct tree *tree_ref(struct tree *tree);
+struct tree *unshare_tree(struct tree *tree);
+int sort_tree_entries(struct tree *tree);
+struct tree_entry *find_tree_entry(struct tree *tree, const char *name);
+int merge_tree_entries(struct tree *tree, struct tree_entry *list);
+struct tree_entry *remove_tree_entry(struct tree *tree, const char *name);
 void free_tree_entry(struct tree_entry *entry);
 void free_tree_entries(struct tree_entry *entry);
 void free_tree(struct tree *t);
 int serialize_tree(FILE *out, struct tree *tree);
 int deserialize_tree(FILE *in, struct tree **tree);
-int restore_directory(struct tree *tree, const char *dir_path);
-struct tree_entry *clone_tree_entry(const struct tree_entry *original);
+void encode_tree(struct buffer *buf, const struct tree *tree);
+void encode_tree_entry(struct buffer *buf, const struct tree_entry *entry);
+int decode_tree(struct reader *rd, struct arena *arena, struct tree **tree);
+struct tree_entry *decode_tree_entry(struct reader *rd, struct arena *arena);
+struct tree_entry *find_tree_path(struct tree *tree, const char *path);
+int restore_directory(struct tree *tree, const char *dir_path, const char *rel_path);
+struct tree_entry *clone_tree_entry(struct arena *arena, const struct tree_entry *original);
 int print_tree(struct tree *tree, int depth, int *total_entries);
 int print_tree_structure(struct tree *root);
 